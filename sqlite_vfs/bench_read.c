@@ -0,0 +1,237 @@
+/*
+** Microbenchmarks for vfstraceRead(), the path every page SQLite reads
+** from a compressed database goes through.  This file includes
+** vfs_snappy.c so that it can open a file through the VFS and then call
+** vfstraceRead() directly, with none of SQLite's pager in the way.
+**
+** USAGE:
+**
+**    bench_read [--ms=N] compressed.sqlite.sz
+**
+** Each shape of read is timed with the block cache off, with a cache too
+** small to hold the file (so nearly every read misses and evicts), and
+** with a cache that already holds every block:
+**
+**    aligned     one whole block, starting on a block boundary
+**    unaligned   100 bytes starting part way into a block
+**    multi       four blocks' worth, starting part way into a block
+**
+** Offsets are random but the same on every run.  Each row reports the
+** time per call and the bytes returned per CPU cycle (by the time stamp
+** counter, where there is one).  Run each case for --ms milliseconds,
+** 500 by default.  Build and run with "make microbench".
+*/
+#define SQLITE_CORE 1
+#include "vfs_snappy.c"
+
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# define BENCH_CYCLES() __rdtsc()
+#else
+# define BENCH_CYCLES() 0
+#endif
+
+#define BENCH_NOFFSET 4096        /* Random offsets, reused round robin */
+
+static double benchNow(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/*
+** xorshift32, for a block number below nBlock.
+*/
+static sqlite3_int64 benchRandomBlock(unsigned int *piSeed, sqlite3_int64 n){
+  unsigned int x = *piSeed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *piSeed = x;
+  return (sqlite3_int64)(x % (sqlite3_uint64)n);
+}
+
+/*
+** Open zPath through pVfs with the given cache size.  Returns the open
+** file, or 0 after printing why not.  The name it was opened by is left
+** in *pzName, to be freed with sqlite3_free_filename() once it is closed.
+*/
+static sqlite3_file *benchOpen(
+  sqlite3_vfs *pVfs,
+  const char *zPath,
+  int nMB,
+  char **pzName
+){
+  sqlite3_file *pFile;
+  char *zName;
+  char zCache[16];
+  const char *azParam[4];
+  int rc;
+
+  sqlite3_snprintf(sizeof(zCache), zCache, "%d", nMB);
+  azParam[0] = "cache_mb";
+  azParam[1] = zCache;
+  azParam[2] = "prefetch";
+  azParam[3] = "0";
+  *pzName = zName = (char*)sqlite3_create_filename(zPath, "", "", 2, azParam);
+  pFile = sqlite3_malloc(pVfs->szOsFile);
+  if( zName==0 || pFile==0 ){
+    fprintf(stderr, "out of memory\n");
+    return 0;
+  }
+  memset(pFile, 0, pVfs->szOsFile);
+  rc = pVfs->xOpen(pVfs, zName, pFile,
+                   SQLITE_OPEN_MAIN_DB|SQLITE_OPEN_READONLY, 0);
+  if( rc!=SQLITE_OK ){
+    fprintf(stderr, "%s: cannot open: %s\n", zPath, sqlite3_errstr(rc));
+    sqlite3_free(pFile);
+    return 0;
+  }
+  return pFile;
+}
+
+/*
+** Call vfstraceRead() for iAmt bytes at each offset in aOfst, round robin,
+** for rSeconds, and print a line of results.
+*/
+static int benchCase(
+  const char *zCase,
+  const char *zCache,
+  sqlite3_file *pFile,
+  const sqlite3_int64 *aOfst,
+  int iAmt,
+  double rSeconds
+){
+  char *zBuf = sqlite3_malloc(iAmt);
+  sqlite3_int64 nOp = 0;
+  sqlite3_uint64 nCycle;
+  double rStart, rElapsed;
+  int rc = SQLITE_OK;
+
+  if( zBuf==0 ) return SQLITE_NOMEM;
+  rStart = benchNow();
+  nCycle = BENCH_CYCLES();
+  do{
+    int i;
+    for(i=0; i<256 && rc==SQLITE_OK; i++, nOp++){
+      rc = vfstraceRead(pFile, zBuf, iAmt, aOfst[nOp % BENCH_NOFFSET]);
+    }
+    rElapsed = benchNow() - rStart;
+  }while( rElapsed<rSeconds && rc==SQLITE_OK );
+  nCycle = BENCH_CYCLES() - nCycle;
+  sqlite3_free(zBuf);
+
+  if( rc!=SQLITE_OK ){
+    fprintf(stderr, "%s %s: read failed: %s\n", zCase, zCache,
+            sqlite3_errstr(rc));
+    return rc;
+  }
+  printf("%-10s %-8s %8d %12lld %10.1f", zCase, zCache, iAmt, nOp,
+         rElapsed*1e9/nOp);
+  if( nCycle>0 ){
+    printf(" %12.3f\n", (double)nOp*iAmt/nCycle);
+  }else{
+    printf(" %12s\n", "-");
+  }
+  return SQLITE_OK;
+}
+
+int main(int argc, char **argv){
+  static const struct {
+    const char *zCache;
+    int nMB;                      /* Cache size, -1 for enough for all */
+  } aCache[] = {
+    { "off",   0 },
+    { "miss",  1 },
+    { "hit",  -1 },
+  };
+  sqlite3_vfs *pVfs;
+  sqlite3_int64 aOfst[3][BENCH_NOFFSET];
+  unsigned int iSeed = 2463534242u;
+  double rSeconds = 0.5;
+  const char *zPath;
+  int i, j, rc;
+
+  for(i=1; i<argc-1 && strncmp(argv[i], "--ms=", 5)==0; i++){
+    rSeconds = atoi(&argv[i][5]) / 1000.0;
+  }
+  if( i!=argc-1 || rSeconds<=0 ){
+    fprintf(stderr, "Usage: %s [--ms=N] compressed.sqlite.sz\n", argv[0]);
+    return 1;
+  }
+  zPath = argv[i];
+
+  rc = vfstrace_register("bench_read", 0, 0, 0, 0);
+  if( rc!=SQLITE_OK ){
+    fprintf(stderr, "cannot register VFS: %s\n", sqlite3_errstr(rc));
+    return 1;
+  }
+  pVfs = sqlite3_vfs_find("bench_read");
+
+  printf("%-10s %-8s %8s %12s %10s %12s\n",
+         "case", "cache", "bytes", "ops", "ns_op", "bytes_cycle");
+  for(j=0; j<(int)(sizeof(aCache)/sizeof(aCache[0])); j++){
+    sqlite3_file *pFile;
+    vfstrace_file *p;
+    char *zName;
+    sqlite3_int64 nMB = aCache[j].nMB;
+    int k;
+
+    if( nMB<0 ){
+      pFile = benchOpen(pVfs, zPath, 1, &zName);
+      if( pFile==0 ) return 1;
+      p = (vfstrace_file*)pFile;
+      nMB = (p->nBlock*(sqlite3_int64)p->iBlockSize >> 20) * 2 + 1;
+      pFile->pMethods->xClose(pFile);
+      sqlite3_free(pFile);
+      sqlite3_free_filename(zName);
+    }
+    pFile = benchOpen(pVfs, zPath, (int)nMB, &zName);
+    if( pFile==0 ) return 1;
+    p = (vfstrace_file*)pFile;
+    if( p->aComp==0 || p->nBlock<8 ){
+      fprintf(stderr, "%s: not a compressed file of 8 or more blocks\n",
+              zPath);
+      return 1;
+    }
+    if( j==1 && p->nBlock*(sqlite3_int64)p->iBlockSize<(8<<20) ){
+      fprintf(stderr, "warning: file is small, so the \"miss\" cache will"
+                      " mostly hit\n");
+    }
+
+    /* Offsets that leave room for the longest read before the last block */
+    for(k=0; k<BENCH_NOFFSET; k++){
+      sqlite3_int64 iBlock = benchRandomBlock(&iSeed, p->nBlock-5);
+      aOfst[0][k] = iBlock*p->iBlockSize;
+      aOfst[1][k] = iBlock*p->iBlockSize + p->iBlockSize/3;
+      aOfst[2][k] = iBlock*p->iBlockSize + p->iBlockSize/2;
+    }
+
+    if( aCache[j].nMB<0 ){
+      /* Warm the cache with every block */
+      char *zBuf = sqlite3_malloc(p->iBlockSize);
+      sqlite3_int64 iBlock;
+      for(iBlock=0; zBuf && iBlock<p->nBlock; iBlock++){
+        vfstraceRead(pFile, zBuf, 1, iBlock*p->iBlockSize);
+      }
+      sqlite3_free(zBuf);
+    }
+
+    rc = benchCase("aligned", aCache[j].zCache, pFile, aOfst[0],
+                   p->iBlockSize, rSeconds);
+    if( rc==SQLITE_OK ){
+      rc = benchCase("unaligned", aCache[j].zCache, pFile, aOfst[1],
+                     100, rSeconds);
+    }
+    if( rc==SQLITE_OK ){
+      rc = benchCase("multi", aCache[j].zCache, pFile, aOfst[2],
+                     p->iBlockSize*4, rSeconds);
+    }
+    pFile->pMethods->xClose(pFile);
+    sqlite3_free(pFile);
+    sqlite3_free_filename(zName);
+    if( rc!=SQLITE_OK ) return 1;
+  }
+  return 0;
+}
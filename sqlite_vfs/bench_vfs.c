@@ -0,0 +1,411 @@
+/*
+** This program measures what the compressed VFS costs real queries.  It
+** runs the same mix of point lookups, range scans and aggregates against
+** an uncompressed database opened through the default VFS, and then
+** against its compressed copy opened through the VFS that
+** vfstrace_register_config() creates, and reports queries per second and
+** latency percentiles for each kind of query on each.
+**
+** USAGE:
+**
+**    bench_vfs [options] raw.sqlite compressed.sqlite.sz
+**
+**    --threads=N       Connections running queries at once (default 1)
+**    --seconds=S       How long to run each VFS for (default 5)
+**    --mix=P,R,A       Relative weights of point lookups, range scans
+**                      and aggregates (default 80,15,5)
+**    --table=T         Table to query (default the first in the schema)
+**    --range=N         Rows per range scan and aggregate (default 100
+**                      and 10000)
+**    --point-sql=SQL   Override the query used for each kind.  ?1 is
+**    --range-sql=SQL   bound to a random rowid of the table and ?2 to
+**    --agg-sql=SQL     the number of rows given by --range.
+**    --config=STR      VFS init string (default $VFS_SNAPPY_CONFIG)
+**
+** Each thread has its own connection and its own random number sequence,
+** seeded from the thread number, so both VFSes see the same queries.
+** Build with "make bench_vfs"; this file is linked with vfs_snappy.c
+** compiled with -DSQLITE_CORE.
+*/
+#include <sqlite3.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int vfstrace_register_config(const char *zConfig);
+
+/*
+** The kinds of query in a workload.
+*/
+#define BENCH_POINT  0
+#define BENCH_RANGE  1
+#define BENCH_AGG    2
+#define BENCH_NKIND  3
+
+static const char *azKind[BENCH_NKIND] = { "point", "range", "aggregate" };
+
+/*
+** Settings shared by every thread.
+*/
+typedef struct bench_config bench_config;
+struct bench_config {
+  const char *zUri;               /* Database to open, as a URI */
+  const char *azSql[BENCH_NKIND]; /* Query for each kind */
+  int aRange[BENCH_NKIND];        /* Value bound to ?2 for each kind */
+  int aMix[BENCH_NKIND];          /* Relative weight of each kind */
+  sqlite3_int64 iMinRowid;        /* Rowids queried are in this range */
+  sqlite3_int64 iMaxRowid;
+  double rSeconds;                /* How long to run for */
+};
+
+/*
+** Latencies in microseconds, for one kind of query.
+*/
+typedef struct bench_latency bench_latency;
+struct bench_latency {
+  double *aUs;                    /* One per query */
+  int nUs;                        /* Number used */
+  int nAlloc;                     /* Number allocated */
+};
+
+/*
+** One thread and its results.
+*/
+typedef struct bench_thread bench_thread;
+struct bench_thread {
+  bench_config *pConfig;
+  unsigned int iSeed;             /* Random number state */
+  bench_latency aLat[BENCH_NKIND];
+  char *zErr;                     /* Error message, from sqlite3_mprintf() */
+};
+
+static double benchNow(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/*
+** xorshift32.  Good enough to pick rowids, and the same on every run.
+*/
+static unsigned int benchRandom(unsigned int *piSeed){
+  unsigned int x = *piSeed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *piSeed = x;
+}
+
+static int benchLatencyAdd(bench_latency *p, double rUs){
+  if( p->nUs==p->nAlloc ){
+    int nNew = p->nAlloc ? p->nAlloc*2 : 1024;
+    double *aNew = realloc(p->aUs, nNew*sizeof(double));
+    if( aNew==0 ) return SQLITE_NOMEM;
+    p->aUs = aNew;
+    p->nAlloc = nNew;
+  }
+  p->aUs[p->nUs++] = rUs;
+  return SQLITE_OK;
+}
+
+/*
+** Run queries for pConfig->rSeconds.  Called on its own thread.
+*/
+static void *benchThread(void *pArg){
+  bench_thread *p = (bench_thread*)pArg;
+  bench_config *pConfig = p->pConfig;
+  sqlite3 *db = 0;
+  sqlite3_stmt *apStmt[BENCH_NKIND] = {0, 0, 0};
+  sqlite3_int64 nRowid = pConfig->iMaxRowid - pConfig->iMinRowid + 1;
+  int nWeight = 0;
+  double rEnd;
+  int rc;
+  int i;
+
+  for(i=0; i<BENCH_NKIND; i++) nWeight += pConfig->aMix[i];
+
+  rc = sqlite3_open_v2(pConfig->zUri, &db,
+           SQLITE_OPEN_READONLY|SQLITE_OPEN_URI|SQLITE_OPEN_NOMUTEX, 0);
+  for(i=0; rc==SQLITE_OK && i<BENCH_NKIND; i++){
+    if( pConfig->aMix[i]==0 ) continue;
+    rc = sqlite3_prepare_v2(db, pConfig->azSql[i], -1, &apStmt[i], 0);
+  }
+
+  rEnd = benchNow() + pConfig->rSeconds;
+  while( rc==SQLITE_OK && benchNow()<rEnd ){
+    int r = (int)(benchRandom(&p->iSeed) % nWeight);
+    sqlite3_int64 iRowid;
+    double rStart;
+
+    for(i=0; r>=pConfig->aMix[i]; i++) r -= pConfig->aMix[i];
+    iRowid = pConfig->iMinRowid
+           + (sqlite3_int64)(benchRandom(&p->iSeed) % nRowid);
+
+    rStart = benchNow();
+    sqlite3_bind_int64(apStmt[i], 1, iRowid);
+    sqlite3_bind_int(apStmt[i], 2, pConfig->aRange[i]);
+    while( (rc = sqlite3_step(apStmt[i]))==SQLITE_ROW ){}
+    if( rc==SQLITE_DONE ) rc = sqlite3_reset(apStmt[i]);
+    if( rc==SQLITE_OK ){
+      rc = benchLatencyAdd(&p->aLat[i], (benchNow() - rStart)*1e6);
+    }
+  }
+
+  if( rc!=SQLITE_OK ){
+    p->zErr = sqlite3_mprintf("%s: %s", pConfig->zUri,
+                              db ? sqlite3_errmsg(db) : sqlite3_errstr(rc));
+  }
+  for(i=0; i<BENCH_NKIND; i++) sqlite3_finalize(apStmt[i]);
+  sqlite3_close(db);
+  return 0;
+}
+
+static int benchCompare(const void *a, const void *b){
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return x<y ? -1 : x>y;
+}
+
+/*
+** Run the workload against one database on nThread threads and print a
+** line per kind of query.  Returns non-zero on error.
+*/
+static int benchRun(const char *zLabel, bench_config *pConfig, int nThread){
+  bench_thread *aThread;
+  pthread_t *aId;
+  int nErr = 0;
+  int i, k;
+
+  aThread = calloc(nThread, sizeof(bench_thread));
+  aId = calloc(nThread, sizeof(pthread_t));
+  if( aThread==0 || aId==0 ){
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  for(i=0; i<nThread; i++){
+    aThread[i].pConfig = pConfig;
+    aThread[i].iSeed = 2463534242u + i*7919;
+    pthread_create(&aId[i], 0, benchThread, &aThread[i]);
+  }
+  for(i=0; i<nThread; i++){
+    pthread_join(aId[i], 0);
+    if( aThread[i].zErr ){
+      fprintf(stderr, "%s\n", aThread[i].zErr);
+      sqlite3_free(aThread[i].zErr);
+      nErr++;
+    }
+  }
+
+  /* Merge the threads' latencies for each kind, then sort for percentiles */
+  for(k=0; k<BENCH_NKIND && nErr==0; k++){
+    bench_latency all = {0, 0, 0};
+    for(i=0; i<nThread; i++){
+      bench_latency *p = &aThread[i].aLat[k];
+      int j;
+      for(j=0; j<p->nUs; j++) benchLatencyAdd(&all, p->aUs[j]);
+    }
+    if( all.nUs>0 ){
+      qsort(all.aUs, all.nUs, sizeof(double), benchCompare);
+      printf("%-10s %-9s %9d %10.0f %9.1f %9.1f %9.1f %9.1f\n",
+             zLabel, azKind[k], all.nUs, all.nUs/pConfig->rSeconds,
+             all.aUs[all.nUs/2], all.aUs[(int)(all.nUs*0.90)],
+             all.aUs[(int)(all.nUs*0.99)], all.aUs[all.nUs-1]);
+    }
+    free(all.aUs);
+  }
+
+  for(i=0; i<nThread; i++){
+    for(k=0; k<BENCH_NKIND; k++) free(aThread[i].aLat[k].aUs);
+  }
+  free(aThread);
+  free(aId);
+  return nErr;
+}
+
+/*
+** Find the table to query, if none was given, the range of its rowids,
+** and an expression summing the lengths of all its columns, so that
+** aggregates have to read whole rows, from the uncompressed database.
+** Returns non-zero on error.
+*/
+static int benchInspect(
+  const char *zPath,
+  char **pzTable,
+  char **pzSum,
+  bench_config *p
+){
+  sqlite3 *db = 0;
+  sqlite3_stmt *pStmt = 0;
+  char *zSql;
+  int rc;
+
+  rc = sqlite3_open_v2(zPath, &db, SQLITE_OPEN_READONLY, 0);
+  if( rc==SQLITE_OK && *pzTable==0 ){
+    rc = sqlite3_prepare_v2(db,
+        "SELECT name FROM sqlite_master WHERE type='table'"
+        " AND name NOT LIKE 'sqlite_%' ORDER BY rowid LIMIT 1", -1, &pStmt, 0);
+    if( rc==SQLITE_OK && sqlite3_step(pStmt)==SQLITE_ROW ){
+      *pzTable = sqlite3_mprintf("%s", sqlite3_column_text(pStmt, 0));
+    }
+    sqlite3_finalize(pStmt);
+    pStmt = 0;
+    if( rc==SQLITE_OK && *pzTable==0 ){
+      fprintf(stderr, "%s: no tables\n", zPath);
+      sqlite3_close(db);
+      return 1;
+    }
+  }
+  if( rc==SQLITE_OK ){
+    zSql = sqlite3_mprintf("PRAGMA table_info(\"%w\")", *pzTable);
+    rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+    sqlite3_free(zSql);
+    *pzSum = sqlite3_mprintf("0");
+    while( rc==SQLITE_OK && *pzSum && sqlite3_step(pStmt)==SQLITE_ROW ){
+      char *zNew = sqlite3_mprintf("%s+total(length(\"%w\"))", *pzSum,
+                                   sqlite3_column_text(pStmt, 1));
+      sqlite3_free(*pzSum);
+      *pzSum = zNew;
+    }
+    sqlite3_finalize(pStmt);
+    pStmt = 0;
+    if( rc==SQLITE_OK && *pzSum==0 ) rc = SQLITE_NOMEM;
+  }
+  if( rc==SQLITE_OK ){
+    zSql = sqlite3_mprintf("SELECT min(rowid), max(rowid) FROM \"%w\"",
+                           *pzTable);
+    rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+    sqlite3_free(zSql);
+  }
+  if( rc==SQLITE_OK && sqlite3_step(pStmt)==SQLITE_ROW ){
+    p->iMinRowid = sqlite3_column_int64(pStmt, 0);
+    p->iMaxRowid = sqlite3_column_int64(pStmt, 1);
+  }
+  sqlite3_finalize(pStmt);
+  if( rc!=SQLITE_OK ){
+    fprintf(stderr, "%s: %s\n", zPath, sqlite3_errmsg(db));
+  }else if( p->iMaxRowid<p->iMinRowid ){
+    fprintf(stderr, "%s: table \"%s\" is empty\n", zPath, *pzTable);
+    rc = SQLITE_ERROR;
+  }
+  sqlite3_close(db);
+  return rc!=SQLITE_OK;
+}
+
+static void benchUsage(const char *zArgv0){
+  fprintf(stderr,
+    "Usage: %s [--threads=N] [--seconds=S] [--mix=P,R,A] [--table=T]\n"
+    "          [--range=N] [--point-sql=SQL] [--range-sql=SQL] [--agg-sql=SQL]\n"
+    "          [--config=STR] raw.sqlite compressed.sqlite.sz\n", zArgv0);
+}
+
+int main(int argc, char **argv){
+  bench_config config;
+  const char *zConfig = getenv("VFS_SNAPPY_CONFIG");
+  char *zVfs = 0;
+  char *zTable = 0;
+  char *zSum = 0;
+  char *azDefault[BENCH_NKIND];
+  int nThread = 1;
+  int nErr = 0;
+  int i;
+
+  memset(&config, 0, sizeof(config));
+  config.aMix[BENCH_POINT] = 80;
+  config.aMix[BENCH_RANGE] = 15;
+  config.aMix[BENCH_AGG] = 5;
+  config.aRange[BENCH_RANGE] = 100;
+  config.aRange[BENCH_AGG] = 10000;
+  config.rSeconds = 5.0;
+
+  for(i=1; i<argc && strncmp(argv[i], "--", 2)==0; i++){
+    const char *z = argv[i] + 2;
+    const char *zVal = strchr(z, '=');
+    int n = zVal ? (int)(zVal - z) : (int)strlen(z);
+    if( zVal ) zVal++;
+    if( zVal==0 ){
+      benchUsage(argv[0]);
+      return 1;
+    }else if( n==7 && strncmp(z, "threads", n)==0 ){
+      nThread = atoi(zVal);
+    }else if( n==7 && strncmp(z, "seconds", n)==0 ){
+      config.rSeconds = atof(zVal);
+    }else if( n==3 && strncmp(z, "mix", n)==0 ){
+      if( sscanf(zVal, "%d,%d,%d", &config.aMix[0], &config.aMix[1],
+                 &config.aMix[2])!=3 ){
+        benchUsage(argv[0]);
+        return 1;
+      }
+    }else if( n==5 && strncmp(z, "table", n)==0 ){
+      zTable = sqlite3_mprintf("%s", zVal);
+    }else if( n==5 && strncmp(z, "range", n)==0 ){
+      config.aRange[BENCH_RANGE] = config.aRange[BENCH_AGG] = atoi(zVal);
+    }else if( n==9 && strncmp(z, "point-sql", n)==0 ){
+      config.azSql[BENCH_POINT] = zVal;
+    }else if( n==9 && strncmp(z, "range-sql", n)==0 ){
+      config.azSql[BENCH_RANGE] = zVal;
+    }else if( n==7 && strncmp(z, "agg-sql", n)==0 ){
+      config.azSql[BENCH_AGG] = zVal;
+    }else if( n==6 && strncmp(z, "config", n)==0 ){
+      zConfig = zVal;
+    }else{
+      benchUsage(argv[0]);
+      return 1;
+    }
+  }
+  if( argc-i!=2 || nThread<1 || config.rSeconds<=0
+   || config.aMix[0]<0 || config.aMix[1]<0 || config.aMix[2]<0
+   || config.aMix[0]+config.aMix[1]+config.aMix[2]<=0 ){
+    benchUsage(argv[0]);
+    return 1;
+  }
+
+  if( vfstrace_register_config(zConfig)!=SQLITE_OK ){
+    fprintf(stderr, "cannot register VFS from \"%s\"\n", zConfig);
+    return 1;
+  }
+
+  /* The VFS is opened by the name the config gave it */
+  for(i=0; zConfig && zConfig[i]; i += (int)strcspn(&zConfig[i], "&")){
+    if( zConfig[i]=='&' ) i++;
+    if( strncmp(&zConfig[i], "name=", 5)==0 ){
+      sqlite3_free(zVfs);
+      zVfs = sqlite3_mprintf("%.*s", (int)strcspn(&zConfig[i+5], "&"),
+                             &zConfig[i+5]);
+    }
+  }
+  if( zVfs==0 ) zVfs = sqlite3_mprintf("snappy");
+
+  if( benchInspect(argv[argc-2], &zTable, &zSum, &config) ) return 1;
+
+  azDefault[BENCH_POINT] = sqlite3_mprintf(
+      "SELECT * FROM \"%w\" WHERE rowid=?1", zTable);
+  azDefault[BENCH_RANGE] = sqlite3_mprintf(
+      "SELECT * FROM \"%w\" WHERE rowid>=?1 ORDER BY rowid LIMIT ?2", zTable);
+  azDefault[BENCH_AGG] = sqlite3_mprintf(
+      "SELECT count(*), %s FROM \"%w\" WHERE rowid>=?1 AND rowid<?1+?2",
+      zSum, zTable);
+  for(i=0; i<BENCH_NKIND; i++){
+    if( config.azSql[i]==0 ) config.azSql[i] = azDefault[i];
+  }
+
+  printf("%-10s %-9s %9s %10s %9s %9s %9s %9s\n", "vfs", "query",
+         "queries", "qps", "p50_us", "p90_us", "p99_us", "max_us");
+
+  i = argc-2;
+  config.zUri = sqlite3_mprintf("file:%s", argv[i]);
+  nErr += benchRun("default", &config, nThread);
+  sqlite3_free((char*)config.zUri);
+
+  config.zUri = sqlite3_mprintf("file:%s?vfs=%s", argv[i+1], zVfs);
+  nErr += benchRun(zVfs, &config, nThread);
+  sqlite3_free((char*)config.zUri);
+
+  for(i=0; i<BENCH_NKIND; i++) sqlite3_free(azDefault[i]);
+  sqlite3_free(zTable);
+  sqlite3_free(zSum);
+  sqlite3_free(zVfs);
+  return nErr!=0;
+}
@@ -106,37 +106,266 @@
 ** the shell.c source file will know to include the -vfstrace command-line
 ** option and (2) you must compile and link the three source files
 ** shell,c, test_vfstrace.c, and sqlite3.c.  
+**
+**
+** LOADING AS AN EXTENSION
+**
+** The same source file can be built as a run-time loadable extension so
+** that the sqlite3 shell, Python, or any other program linked against a
+** stock SQLite can read compressed databases without being rebuilt:
+**
+**    cc -fPIC -shared -o vfs_snappy.so vfs_snappy.c -lsnappy -llzo2
+**
+** (or "make" in this directory).  Loading the extension registers the
+** VFS and keeps it registered after the loading connection closes:
+**
+**    sqlite> .load ./vfs_snappy
+**    sqlite> .open file:census.sqlite.sz?vfs=snappy
+**
+** A database in an archive written by "snappy-sqlite --archive" is opened
+** by the archive's path, which must end in ".zsq", and then its name:
+**
+**    sqlite> .open file:all.zsq/census.sqlite?vfs=snappy
+**
+** The VFS is configured by an init string read from the VFS_SNAPPY_CONFIG
+** environment variable, for example "name=snappy&default=1".  See
+** vfstrace_register_config() for the recognized keys.  Programs that link
+** this file directly must compile it with -DSQLITE_CORE, in which case no
+** extension entry point is emitted.
 */
 #include <snappy-c.h>
+#include <lzo/lzo1x.h>
 
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "sqlite3.h"
+#if defined(__unix__) || defined(__APPLE__)
+# include <sys/mman.h>
+# include <fcntl.h>
+# include <unistd.h>
+# define VFSTRACE_USE_MMAP 1
+#endif
+#include "sqlite3ext.h"
+SQLITE_EXTENSION_INIT1
 
 /*
 ** An instance of this structure is attached to the each trace VFS to
 ** provide auxiliary information.
 */
 typedef struct vfstrace_info vfstrace_info;
+typedef struct vfstrace_file vfstrace_file;
+typedef struct vfstrace_block vfstrace_block;
 struct vfstrace_info {
   sqlite3_vfs *pRootVfs;              /* The underlying real VFS */
   int (*xOut)(const char*, void*);    /* Send output here */
   void *pOutArg;                      /* First argument to xOut */
   const char *zVfsName;               /* Name of this trace-VFS */
   sqlite3_vfs *pTraceVfs;             /* Pointer back to the trace VFS */
+  sqlite3_int64 szCache;              /* Default cache size in bytes */
+  int nPrefetch;                      /* Default blocks prefetched per miss */
+  int bVerify;                        /* Default for verifying blocks */
+  sqlite3_int64 szPin;                /* Default pinned tier size in bytes */
+  sqlite3_mutex *pMutex;              /* Guards the fields below */
+  sqlite3_int64 szBudget;             /* Memory limit of all files, or 0 */
+  sqlite3_int64 szUsed;               /* Memory used by all files */
+  vfstrace_file *pFiles;              /* All open compressed files */
+  char *aArena;                       /* Slots for cached blocks, or NULL */
+  void *pArenaMap;                    /* Mapping that holds aArena */
+  sqlite3_int64 szArenaMap;           /* Size of pArenaMap in bytes */
+  int szSlot;                         /* Bytes per arena slot */
+  int nSlot;                          /* Number of arena slots */
+  int nSlotUsed;                      /* Slots ever handed out */
+  int bArenaFailed;                   /* Do not retry a failed mapping */
+  vfstrace_block *aSlot;              /* aSlot[i] describes slot i */
+  vfstrace_block *pFreeSlot;          /* Free slots, via pHashNext */
+};
+
+/*
+** An uncompressed block held in the cache of a vfstrace_file.  The block
+** data lives in a slot of the VFS arena, or follows the structure in the
+** same allocation if the block did not fit in the arena.
+*/
+struct vfstrace_block {
+  sqlite3_int64 iBlock;         /* Block number */
+  int nData;                    /* Uncompressed bytes of data */
+  int isPinned;                 /* In the pinned tier, not the LRU */
+  char *aData;                  /* The uncompressed data */
+  vfstrace_block *pHashNext;    /* Next block in the same hash slot */
+  vfstrace_block *pPrev;        /* Next more recently used block */
+  vfstrace_block *pNext;        /* Next less recently used, or pinned */
 };
 
+/*
+** The start offsets of the compressed blocks, as an Elias-Fano code.  A
+** flat table of 64-bit offsets costs 2 GiB per open file at 4 KiB blocks
+** of a 1 TiB database.  Here each offset, less the offset of block 0, is
+** split into nLow low bits stored verbatim in aLow[], and high bits stored
+** in unary in aHigh[]: offset i sets bit (high_i + i).  Choosing nLow as
+** log2 of the average block size keeps aHigh[] within 2 bits per offset,
+** so the whole index takes about log2(average size) + 2.5 bits per block.
+**
+** To find the high bits of offset i in O(1), aSelect[] records where the
+** (k*VFSTRACE_SELECT_RATE)-th set bit of aHigh[] is, and the scan onward
+** from there is over a few words at most.
+**
+** Files with VFSTRACE_FLAG_OFFSETS already hold a table of absolute
+** offsets.  Where possible that table is mapped read-only at aMap instead,
+** so that opening the file reads nothing and index pages fault in only as
+** blocks are looked up.
+*/
+typedef struct vfstrace_index vfstrace_index;
+struct vfstrace_index {
+  sqlite3_int64 nOffset;        /* Number of offsets in the index */
+  sqlite3_int64 iBase;          /* Offset of block 0 */
+  int nLow;                     /* Low bits of each offset in aLow[] */
+  sqlite3_uint64 *aLow;         /* Packed nLow-bit low parts */
+  sqlite3_uint64 *aHigh;        /* Unary-coded high parts */
+  sqlite3_int64 *aSelect;       /* Bit of every SELECT_RATE-th offset */
+  sqlite3_int64 nByte;          /* Memory used by the arrays above */
+  const unsigned char *aMap;    /* Mapped on-disk offset table, or NULL */
+  void *pMap;                   /* Start of the mapping holding aMap */
+  sqlite3_int64 szMap;          /* Size of the mapping at pMap */
+};
+
+#define VFSTRACE_SELECT_RATE 128
+
 /*
 ** The sqlite3_file object for the trace VFS
 */
-typedef struct vfstrace_file vfstrace_file;
 struct vfstrace_file {
   sqlite3_file base;        /* Base class.  Must be first */
   vfstrace_info *pInfo;     /* The trace-VFS to which this file belongs */
   const char *zFName;       /* Base name of the file */
+  int iBlockSize;           /* Uncompressed bytes per block */
+  sqlite3_int64 nBlock;     /* Number of compressed blocks */
+  vfstrace_index idx;       /* Where each block starts in the file */
+  unsigned char *aCodec;    /* Codec of each block, 4 bits each */
+  sqlite3_int64 szDb;       /* Uncompressed size of the database */
+  sqlite3_int64 iFirst;     /* Block the database starts at */
+  sqlite3_int64 iEnd;       /* Block after its last */
+  const char *zMember;      /* Name in an archive, or NULL if not in one */
+  char *zArchive;           /* Path of that archive, from create_filename */
+  char *aComp;              /* Compressed blocks read ahead. NULL if raw */
+  int mxComp;               /* Largest valid compressed block */
+  char *aBlock;             /* Buffer for one uncompressed block */
+  sqlite3_int64 mxCache;    /* Maximum bytes of cached blocks */
+  sqlite3_int64 szCache;    /* Bytes of cached blocks in the LRU */
+  sqlite3_int64 mxPin;      /* Maximum bytes of pinned blocks */
+  sqlite3_int64 szPin;      /* Bytes of pinned blocks */
+  int szPage;               /* Database page size, or 0 if unknown */
+  int nPrefetch;            /* Blocks read ahead after each cache miss */
+  int bVerify;              /* Validate blocks before uncompressing */
+  int nWeight;              /* Share of the VFS memory budget */
+  sqlite3_int64 szScratch;  /* Budgeted memory that is not cache */
+  vfstrace_block **apFill;  /* nPrefetch+1 blocks being filled */
+  int nHash;                /* Number of slots in apHash[] */
+  vfstrace_block **apHash;  /* Cached blocks, hashed by block number */
+  vfstrace_block *pMru;     /* Most recently used cached block */
+  vfstrace_block *pLru;     /* Least recently used cached block */
+  vfstrace_block *pPinned;  /* Pinned blocks, linked through pNext */
+  vfstrace_file *pNextFile; /* Next file in vfstrace_info.pFiles */
   sqlite3_file *pReal;      /* The real underlying file */
 };
 
+/*
+** Compressed files, written by zsqlite/snappy-sqlite.cc, start with a
+** header, then an index with one entry per block, and then the compressed
+** blocks back to back.  The current format (version 1) has this
+** VFSTRACE_HEADER_SIZE byte header, with every integer little-endian:
+**
+**     0  char[8]   VFSTRACE_MAGIC
+**     8  uint32    Format version, VFSTRACE_VERSION
+**    12  uint32    Flags, VFSTRACE_FLAG_*
+**    16  uint32    Uncompressed bytes per block
+**    20  uint32    Reserved
+**    24  uint64    Number of blocks
+**    32  uint64    Uncompressed size of the database
+**    40  uint64    Offset of the index
+**    48  uint64    Offset of the first block
+**    56  uint64    Reserved
+**
+** Each index entry is a uint32 holding the compressed size of its block
+** in the low VFSTRACE_CODEC_SHIFT bits, and the codec the block was
+** compressed with in the bits above.
+**
+** If the VFSTRACE_FLAG_OFFSETS flag is set the index instead has one more
+** entry than there are blocks, each a uint64 holding the absolute offset
+** at which a block starts in the low VFSTRACE_OFFSET_CODEC_SHIFT bits and
+** its codec above them.  The last entry is the end of the final block.
+** The index then starts on a page boundary, so that it can be mapped.
+**
+** A file written in a single pass, for example from a pipe, does not know
+** the number of blocks, the uncompressed size or where the index will go
+** until the end.  Its header has VFSTRACE_FLAG_FOOTER set and those fields
+** zero, the index follows the blocks, and the file ends with this
+** VFSTRACE_TRAILER_SIZE byte trailer:
+**
+**     0  char[8]   VFSTRACE_TRAILER_MAGIC
+**     8  uint64    Number of blocks
+**    16  uint64    Uncompressed size of the database
+**    24  uint64    Offset of the index
+**
+** A block with VFSTRACE_CODEC_HOLE is zero bytes long in the file and
+** reads as a whole block of zeros.  The compressor writes these for blocks
+** that were all zeros or held only freelist leaf pages, and they are
+** answered without any I/O or space in the block cache.
+**
+** A block with VFSTRACE_CODEC_REF is identical to an earlier block, and
+** its 8 bytes in the file are the uint64 number of that block, which is
+** stored in full.  It is read, and cached, as that block, so every block
+** with the same contents shares one cache entry.
+**
+** With VFSTRACE_FLAG_HASHES the index is followed by a uint64 hash of each
+** uncompressed block, which the compressor uses to find unchanged blocks
+** when it is run again over a newer copy of the database.  They are not
+** needed to read the file and are skipped here.
+**
+** With VFSTRACE_FLAG_DIRECTORY the file is an archive of databases, each
+** starting on a block boundary and padded with zeros to a whole block.
+** After the hashes, or the index if there are none, comes a directory:
+**
+**     0  uint64    Number of databases
+**     8  uint64    Bytes of entries that follow, each of
+**                    0  uint64   First block of the database
+**                    8  uint64   Uncompressed size of the database
+**                   16  uint32   Length of its name
+**                   20  char[]   The name, without a NUL
+**
+** Each database is read as its own file, so a REF in one database may
+** name a block of another, and the blocks they share are stored once.
+**
+** Files without the magic predate versioning.  They start with two native
+** ints, the block size and the number of blocks, followed by native uint16
+** index entries split at VFSTRACE_LEGACY_CODEC_SHIFT, and do not record
+** the uncompressed size.  Only the short-lived format that first chose a
+** codec per block has those codec bits.  Files from before it have none,
+** and their blocks are LZO1X, which this code would take for snappy, so
+** they cannot be read here.
+*/
+#define VFSTRACE_MAGIC              "zsqlite"  /* Includes the NUL */
+#define VFSTRACE_VERSION            1
+#define VFSTRACE_HEADER_SIZE        64
+#define VFSTRACE_MAX_BLOCK_SIZE     (128*1024*1024)
+#define VFSTRACE_CODEC_SHIFT        28
+#define VFSTRACE_LEGACY_CODEC_SHIFT 13
+#define VFSTRACE_OFFSET_CODEC_SHIFT 60
+
+#define VFSTRACE_FLAG_OFFSETS       0x0001  /* Index of absolute offsets */
+#define VFSTRACE_FLAG_FOOTER        0x0002  /* Index after the blocks */
+#define VFSTRACE_FLAG_HASHES        0x0004  /* Block hashes after the index */
+#define VFSTRACE_FLAG_DIRECTORY     0x0008  /* An archive of databases */
+#define VFSTRACE_ARCHIVE_SUFFIX     ".zsq"
+
+#define VFSTRACE_TRAILER_MAGIC      "zsqlend"  /* Includes the NUL */
+#define VFSTRACE_TRAILER_SIZE       32
+
+#define VFSTRACE_CODEC_SNAPPY 0     /* Snappy */
+#define VFSTRACE_CODEC_LZO    1     /* LZO1X, at any compression level */
+#define VFSTRACE_CODEC_RAW    2     /* Stored uncompressed */
+#define VFSTRACE_CODEC_HOLE   3     /* Not stored, a whole block of zeros */
+#define VFSTRACE_CODEC_REF    4     /* Same as an earlier block */
+
 /*
 ** Method declarations for vfstrace_file.
 */
@@ -177,14 +406,1067 @@ static int vfstraceSetSystemCall(sqlite3_vfs*,const char*, sqlite3_syscall_ptr);
 static sqlite3_syscall_ptr vfstraceGetSystemCall(sqlite3_vfs*, const char *);
 static const char *vfstraceNextSystemCall(sqlite3_vfs*, const char *zName);
 
+/*
+** Return a pointer to the tail of the pathname.  Examples:
+**
+**     /home/drh/xyzzy.txt -> xyzzy.txt
+**     xyzzy.txt           -> xyzzy.txt
+*/
+static const char *fileTail(const char *z){
+  int i;
+  if( z==0 ) return 0;
+  i = strlen(z)-1;
+  while( i>0 && z[i-1]!='/' ){ i--; }
+  return &z[i];
+}
+
+/*
+** If zPath names a database in an archive, as "dir/all.zsq/name", return
+** the length of the archive's path, and otherwise 0.
+*/
+static int vfstraceArchiveSplit(const char *zPath){
+  const char *zSlash = zPath ? strrchr(zPath, '/') : 0;
+  int nSuffix = (int)strlen(VFSTRACE_ARCHIVE_SUFFIX);
+  if( zSlash==0 || zSlash[1]==0 || zSlash-zPath<=nSuffix ) return 0;
+  if( memcmp(zSlash-nSuffix, VFSTRACE_ARCHIVE_SUFFIX, nSuffix)!=0 ) return 0;
+  return (int)(zSlash-zPath);
+}
+
+/*
+** Send trace output defined by zFormat and subsequent arguments.
+*/
+static void vfstrace_printf(
+  vfstrace_info *pInfo,
+  const char *zFormat,
+  ...
+){
+  va_list ap;
+  char *zMsg;
+  if( pInfo->xOut==0 ) return;
+  va_start(ap, zFormat);
+  zMsg = sqlite3_vmprintf(zFormat, ap);
+  va_end(ap);
+  pInfo->xOut(zMsg, pInfo->pOutArg);
+  sqlite3_free(zMsg);
+}
+
+static int vfstraceAttach(vfstrace_file*, sqlite3_int64);
+static int vfstraceReadBlock(vfstrace_file*, sqlite3_int64, char*, size_t*);
+static int vfstraceResolve(vfstrace_file*, sqlite3_int64, sqlite3_int64*);
+
+/*
+** Bit twiddling for the Elias-Fano index.
+*/
+#if defined(__GNUC__) || defined(__clang__)
+# define vfstracePopcount(X) __builtin_popcountll(X)
+# define vfstraceCtz(X)      __builtin_ctzll(X)
+#else
+static int vfstracePopcount(sqlite3_uint64 x){
+  int n = 0;
+  while( x ){ x &= x-1; n++; }
+  return n;
+}
+static int vfstraceCtz(sqlite3_uint64 x){
+  int n = 0;
+  while( (x & 1)==0 ){ x >>= 1; n++; }
+  return n;
+}
+#endif
+
+/*
+** Allocate an index for nOffset ascending offsets, the first of which
+** is iBase and none of which is larger than iMax.
+*/
+static int vfstraceIndexInit(
+  vfstrace_index *pIdx,
+  sqlite3_int64 nOffset,
+  sqlite3_int64 iBase,
+  sqlite3_int64 iMax
+){
+  sqlite3_int64 nLowWord, nHighWord, nSelect;
+
+  pIdx->nOffset = nOffset;
+  pIdx->iBase = iBase;
+  pIdx->nLow = 0;
+  while( ((iMax-iBase) >> (pIdx->nLow+1)) >= nOffset ) pIdx->nLow++;
+  nLowWord = (nOffset*pIdx->nLow + 63)/64 + 1;
+  nHighWord = (nOffset + ((iMax-iBase) >> pIdx->nLow) + 63)/64 + 1;
+  nSelect = nOffset/VFSTRACE_SELECT_RATE + 1;
+  pIdx->nByte = (nLowWord + nHighWord)*sizeof(sqlite3_uint64)
+              + nSelect*sizeof(sqlite3_int64);
+  pIdx->aLow = sqlite3_malloc64(pIdx->nByte);
+  if( pIdx->aLow==0 ) return SQLITE_NOMEM;
+  memset(pIdx->aLow, 0, pIdx->nByte);
+  pIdx->aHigh = &pIdx->aLow[nLowWord];
+  pIdx->aSelect = (sqlite3_int64*)&pIdx->aHigh[nHighWord];
+  return SQLITE_OK;
+}
+
+/*
+** Set offset i of the index.  Offsets must be set in ascending order.
+*/
+static void vfstraceIndexSet(
+  vfstrace_index *pIdx,
+  sqlite3_int64 i,
+  sqlite3_int64 iOfst
+){
+  sqlite3_uint64 v = (sqlite3_uint64)(iOfst - pIdx->iBase);
+  sqlite3_int64 iBit;
+  if( pIdx->nLow>0 ){
+    sqlite3_uint64 iLow = v & (((sqlite3_uint64)1<<pIdx->nLow) - 1);
+    iBit = i*pIdx->nLow;
+    pIdx->aLow[iBit/64] |= iLow << (iBit%64);
+    if( iBit%64 + pIdx->nLow > 64 ){
+      pIdx->aLow[iBit/64+1] |= iLow >> (64 - iBit%64);
+    }
+  }
+  iBit = (sqlite3_int64)(v >> pIdx->nLow) + i;
+  pIdx->aHigh[iBit/64] |= (sqlite3_uint64)1 << (iBit%64);
+  if( i%VFSTRACE_SELECT_RATE==0 ){
+    pIdx->aSelect[i/VFSTRACE_SELECT_RATE] = iBit;
+  }
+}
+
+/*
+** Read little-endian integers from the file header and index.
+*/
+static unsigned int vfstraceGet32(const unsigned char *a){
+  return a[0] | (a[1]<<8) | (a[2]<<16) | ((unsigned int)a[3]<<24);
+}
+static sqlite3_int64 vfstraceGet64(const unsigned char *a){
+  return (sqlite3_int64)(vfstraceGet32(a)
+                         | ((sqlite3_uint64)vfstraceGet32(&a[4])<<32));
+}
+
+/*
+** Return offset i of the index.
+*/
+static sqlite3_int64 vfstraceIndexGet(vfstrace_index *pIdx, sqlite3_int64 i){
+  sqlite3_uint64 v = 0;
+  sqlite3_uint64 w;
+  sqlite3_int64 iBit;
+  int nSkip = (int)(i%VFSTRACE_SELECT_RATE);
+  int n;
+
+  if( pIdx->aMap ){
+    return vfstraceGet64(&pIdx->aMap[i*8])
+         & (((sqlite3_int64)1<<VFSTRACE_OFFSET_CODEC_SHIFT) - 1);
+  }
+
+  if( pIdx->nLow>0 ){
+    iBit = i*pIdx->nLow;
+    v = pIdx->aLow[iBit/64] >> (iBit%64);
+    if( iBit%64 + pIdx->nLow > 64 ){
+      v |= pIdx->aLow[iBit/64+1] << (64 - iBit%64);
+    }
+    v &= ((sqlite3_uint64)1<<pIdx->nLow) - 1;
+  }
+
+  /* Find the set bit nSkip bits after the sampled one */
+  iBit = pIdx->aSelect[i/VFSTRACE_SELECT_RATE];
+  w = pIdx->aHigh[iBit/64] & (~(sqlite3_uint64)0 << (iBit%64));
+  iBit -= iBit%64;
+  while( (n = vfstracePopcount(w))<=nSkip ){
+    nSkip -= n;
+    iBit += 64;
+    w = pIdx->aHigh[iBit/64];
+  }
+  while( nSkip-- ) w &= w-1;
+  iBit += vfstraceCtz(w);
+
+  v |= (sqlite3_uint64)(iBit - i) << pIdx->nLow;
+  return pIdx->iBase + (sqlite3_int64)v;
+}
+
+/*
+** Return the codec block iBlock was compressed with.
+*/
+static int vfstraceCodec(vfstrace_file *p, sqlite3_int64 iBlock){
+  if( p->idx.aMap ) return p->idx.aMap[iBlock*8+7] >> 4;
+  return (p->aCodec[iBlock/2] >> ((iBlock&1)*4)) & 0x0f;
+}
+
+/*
+** Map the nByte byte offset table at iIndex of file zName read-only into
+** pIdx->aMap.  Only files opened through the unix VFSes can be mapped
+** this way.  Return non-zero if the table was mapped.
+*/
+static int vfstraceIndexMap(
+  vfstrace_index *pIdx,
+  vfstrace_info *pInfo,
+  const char *zName,
+  sqlite3_int64 iIndex,
+  sqlite3_int64 nByte
+){
+#ifdef VFSTRACE_USE_MMAP
+  sqlite3_int64 szPage = sysconf(_SC_PAGESIZE);
+  sqlite3_int64 iStart = iIndex - iIndex%szPage;
+  void *pMap;
+  int fd;
+
+  if( zName==0 || strncmp(pInfo->pRootVfs->zName, "unix", 4)!=0 ) return 0;
+  fd = open(zName, O_RDONLY);
+  if( fd<0 ) return 0;
+  pMap = mmap(0, nByte + (iIndex-iStart), PROT_READ, MAP_SHARED, fd, iStart);
+  close(fd);
+  if( pMap==MAP_FAILED ) return 0;
+  pIdx->pMap = pMap;
+  pIdx->szMap = nByte + (iIndex-iStart);
+  pIdx->aMap = (const unsigned char*)pMap + (iIndex-iStart);
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/*
+** Release the memory or mapping held by an index.
+*/
+static void vfstraceIndexFree(vfstrace_index *pIdx){
+#ifdef VFSTRACE_USE_MMAP
+  if( pIdx->pMap ) munmap(pIdx->pMap, pIdx->szMap);
+#endif
+  sqlite3_free(pIdx->aLow);
+  memset(pIdx, 0, sizeof(*pIdx));
+}
+
+/*
+** Find p->zMember in the directory of an archive, which lies between iDir
+** and iDirEnd, and narrow p to that database's blocks.  Return
+** SQLITE_CANTOPEN if the archive has no database of that name.
+*/
+static int vfstraceFindMember(
+  vfstrace_file *p,
+  sqlite3_int64 iDir,
+  sqlite3_int64 iDirEnd
+){
+  sqlite3_file *pReal = p->pReal;
+  unsigned char aHead[16];
+  unsigned char *aDir;
+  sqlite3_int64 nMember, nByte, i, j;
+  size_t nName = strlen(p->zMember);
+  int rc;
+
+  if( iDir<0 || iDir+(int)sizeof(aHead)>iDirEnd ) return SQLITE_CORRUPT;
+  rc = pReal->pMethods->xRead(pReal, aHead, sizeof(aHead), iDir);
+  if( rc!=SQLITE_OK ) return rc;
+  nMember = vfstraceGet64(aHead);
+  nByte = vfstraceGet64(&aHead[8]);
+  if( nByte<0 || nByte>iDirEnd-iDir-(int)sizeof(aHead) || nByte>(64<<20) ){
+    return SQLITE_CORRUPT;
+  }
+  aDir = sqlite3_malloc64(nByte+1);
+  if( aDir==0 ) return SQLITE_NOMEM;
+  rc = pReal->pMethods->xRead(pReal, aDir, (int)nByte, iDir+sizeof(aHead));
+  if( rc==SQLITE_IOERR_SHORT_READ ) rc = SQLITE_CORRUPT;
+
+  for(i=j=0; rc==SQLITE_OK && i<nMember; i++){
+    sqlite3_int64 n;
+    if( nByte-j<20 || (n = vfstraceGet32(&aDir[j+16]))>nByte-j-20 ){
+      rc = SQLITE_CORRUPT;
+      break;
+    }
+    if( n==(sqlite3_int64)nName && memcmp(&aDir[j+20], p->zMember, nName)==0 ){
+      p->iFirst = vfstraceGet64(&aDir[j]);
+      p->szDb = vfstraceGet64(&aDir[j+8]);
+      if( p->iFirst<0 || p->iFirst>p->nBlock || p->szDb<0
+       || (p->szDb+p->iBlockSize-1)/p->iBlockSize>p->nBlock-p->iFirst ){
+        rc = SQLITE_CORRUPT;
+      }else{
+        p->iEnd = p->iFirst + (p->szDb+p->iBlockSize-1)/p->iBlockSize;
+      }
+      sqlite3_free(aDir);
+      return rc;
+    }
+    j += 20 + n;
+  }
+  sqlite3_free(aDir);
+  return rc==SQLITE_OK ? SQLITE_CANTOPEN : rc;
+}
+
+/*
+** Read the header and block index of a compressed file, and work out
+** where each block lives and how large the uncompressed database is.
+** For a database in an archive, that is the database's run of blocks.
+*/
+static int vfstraceLoadIndex(vfstrace_file *p, const char *zName){
+  sqlite3_file *pReal = p->pReal;
+  unsigned char aHdr[VFSTRACE_HEADER_SIZE];
+  unsigned char aEntry[4096];     /* A chunk of the on-disk index */
+  sqlite3_int64 szFile;           /* Size of the compressed file */
+  sqlite3_int64 iIndex;           /* Offset of the index */
+  sqlite3_int64 iOfst;            /* Offset of the next block */
+  sqlite3_int64 iDataEnd;         /* Blocks all end before here */
+  sqlite3_int64 iDir;             /* Offset of an archive's directory */
+  sqlite3_int64 nEntry;           /* Number of index entries */
+  sqlite3_int64 szScratch;
+  sqlite3_int64 nComp;            /* Largest possible compressed block */
+  sqlite3_int64 i;
+  unsigned int flags = 0;         /* VFSTRACE_FLAG_* from the header */
+  int szEntry;                    /* Bytes per index entry */
+  int nShift;                     /* Codec bits start here in an entry */
+  int rc;
+
+  rc = pReal->pMethods->xFileSize(pReal, &szFile);
+  if( rc!=SQLITE_OK ) return rc;
+  if( szFile<8 ) return SQLITE_NOTADB;
+  rc = pReal->pMethods->xRead(pReal, aHdr,
+           szFile<VFSTRACE_HEADER_SIZE ? 8 : VFSTRACE_HEADER_SIZE, 0);
+  if( rc!=SQLITE_OK ) return rc;
+
+  if( memcmp(aHdr, VFSTRACE_MAGIC, 8)==0 ){
+    if( szFile<VFSTRACE_HEADER_SIZE
+     || vfstraceGet32(&aHdr[8])!=VFSTRACE_VERSION ){
+      return SQLITE_NOTADB;
+    }
+    flags = vfstraceGet32(&aHdr[12]);
+    p->iBlockSize = (int)vfstraceGet32(&aHdr[16]);
+    p->nBlock = vfstraceGet64(&aHdr[24]);
+    p->szDb = vfstraceGet64(&aHdr[32]);
+    iIndex = vfstraceGet64(&aHdr[40]);
+    iOfst = vfstraceGet64(&aHdr[48]);
+    iDataEnd = szFile;
+    if( flags & ~(VFSTRACE_FLAG_OFFSETS|VFSTRACE_FLAG_FOOTER
+                 |VFSTRACE_FLAG_HASHES|VFSTRACE_FLAG_DIRECTORY) ){
+      return SQLITE_NOTADB;
+    }
+    if( flags & VFSTRACE_FLAG_FOOTER ){
+      unsigned char aTrailer[VFSTRACE_TRAILER_SIZE];
+      if( szFile<VFSTRACE_HEADER_SIZE+VFSTRACE_TRAILER_SIZE ){
+        return SQLITE_CORRUPT;
+      }
+      rc = pReal->pMethods->xRead(pReal, aTrailer, VFSTRACE_TRAILER_SIZE,
+                                  szFile-VFSTRACE_TRAILER_SIZE);
+      if( rc!=SQLITE_OK ) return rc;
+      if( memcmp(aTrailer, VFSTRACE_TRAILER_MAGIC, 8)!=0 ){
+        return SQLITE_CORRUPT;
+      }
+      p->nBlock = vfstraceGet64(&aTrailer[8]);
+      p->szDb = vfstraceGet64(&aTrailer[16]);
+      iIndex = vfstraceGet64(&aTrailer[24]);
+      iDataEnd = iIndex;
+    }
+    if( flags & VFSTRACE_FLAG_OFFSETS ){
+      szEntry = 8;
+      nShift = VFSTRACE_OFFSET_CODEC_SHIFT;
+      nEntry = p->nBlock+1;
+    }else{
+      szEntry = 4;
+      nShift = VFSTRACE_CODEC_SHIFT;
+      nEntry = p->nBlock;
+    }
+    if( p->iBlockSize<=0 || p->iBlockSize>VFSTRACE_MAX_BLOCK_SIZE
+     || p->szDb<0 || p->nBlock!=(p->szDb+p->iBlockSize-1)/p->iBlockSize ){
+      return SQLITE_CORRUPT;
+    }
+  }else{
+    int aLegacy[2];
+    memcpy(aLegacy, aHdr, sizeof(aLegacy));
+    p->iBlockSize = aLegacy[0];
+    p->nBlock = aLegacy[1];
+    p->szDb = -1;
+    iIndex = sizeof(aLegacy);
+    iOfst = iIndex + p->nBlock*2;
+    iDataEnd = szFile;
+    szEntry = 2;
+    nShift = VFSTRACE_LEGACY_CODEC_SHIFT;
+    nEntry = p->nBlock;
+    if( p->iBlockSize<=0 || p->iBlockSize>VFSTRACE_MAX_BLOCK_SIZE
+     || p->nBlock<=0 ){
+      return SQLITE_NOTADB;
+    }
+  }
+  if( flags & VFSTRACE_FLAG_FOOTER ){
+    if( iIndex<iOfst
+     || iIndex+nEntry*szEntry>szFile-VFSTRACE_TRAILER_SIZE ){
+      return SQLITE_CORRUPT;
+    }
+  }else if( iIndex<0 || iIndex+nEntry*szEntry>szFile
+         || iOfst<iIndex+nEntry*szEntry || iOfst>szFile ){
+    return SQLITE_CORRUPT;
+  }
+
+  /* An archive is only opened a database at a time, by name */
+  p->iFirst = 0;
+  p->iEnd = p->nBlock;
+  if( (p->zMember!=0)!=((flags & VFSTRACE_FLAG_DIRECTORY)!=0) ){
+    return SQLITE_CANTOPEN;
+  }
+  if( p->zMember ){
+    iDir = iIndex + nEntry*szEntry;
+    if( flags & VFSTRACE_FLAG_HASHES ) iDir += p->nBlock*8;
+    rc = vfstraceFindMember(p, iDir, (flags & VFSTRACE_FLAG_FOOTER) ?
+                                szFile-VFSTRACE_TRAILER_SIZE : iOfst);
+    if( rc!=SQLITE_OK ) return rc;
+  }
+
+  /* Reads are at most an int, so keep the prefetch window below that */
+  nComp = snappy_max_compressed_length(p->iBlockSize);
+  if( (1+p->nPrefetch)*nComp>(64<<20) ){
+    p->nPrefetch = (int)((64<<20) / nComp) - 1;
+    if( p->nPrefetch<0 ) p->nPrefetch = 0;
+  }
+  p->mxComp = (int)nComp;
+
+  szScratch = nComp*(1+p->nPrefetch) + p->iBlockSize;
+  p->aComp = sqlite3_malloc64(nComp*(1+p->nPrefetch) + p->iBlockSize);
+  if( p->aComp==0 ) return SQLITE_NOMEM;
+  p->aBlock = &p->aComp[nComp*(1+p->nPrefetch)];
+
+  /* An offset table that can be mapped is used as it is.  Its entries
+  ** are checked as blocks are read, rather than all of them up front. */
+  if( (flags & VFSTRACE_FLAG_OFFSETS)
+   && vfstraceIndexMap(&p->idx, p->pInfo, zName, iIndex, nEntry*szEntry) ){
+    if( vfstraceIndexGet(&p->idx, 0)!=iOfst
+     || vfstraceIndexGet(&p->idx, p->nBlock)>iDataEnd ){
+      return SQLITE_CORRUPT;
+    }
+    nEntry = 0;
+  }else{
+    rc = vfstraceIndexInit(&p->idx, p->nBlock+1, iOfst, iDataEnd);
+    if( rc!=SQLITE_OK ) return rc;
+    p->aCodec = sqlite3_malloc64((p->nBlock+2)/2);
+    if( p->aCodec==0 ) return SQLITE_NOMEM;
+    memset(p->aCodec, 0, (p->nBlock+2)/2);
+    szScratch += p->idx.nByte + (p->nBlock+2)/2;
+  }
+
+  for(i=0; i<nEntry; ){
+    int nRead = sizeof(aEntry) / szEntry;
+    int j;
+    if( nRead>nEntry-i ) nRead = (int)(nEntry-i);
+    rc = pReal->pMethods->xRead(pReal, aEntry, nRead*szEntry,
+                                iIndex + i*szEntry);
+    if( rc!=SQLITE_OK ) return rc;
+    for(j=0; j<nRead; j++, i++){
+      sqlite3_uint64 iEntry;
+      sqlite3_int64 nByte;
+      unsigned short iLegacy;
+      if( szEntry==8 ){
+        iEntry = (sqlite3_uint64)vfstraceGet64(&aEntry[j*8]);
+      }else if( szEntry==4 ){
+        iEntry = vfstraceGet32(&aEntry[j*4]);
+      }else{
+        memcpy(&iLegacy, &aEntry[j*2], 2);
+        iEntry = iLegacy;
+      }
+      if( (iEntry >> nShift)>0x0f ) return SQLITE_CORRUPT;
+      if( i<p->nBlock ){
+        p->aCodec[i/2] |= (unsigned char)((iEntry >> nShift) << ((i&1)*4));
+      }
+      iEntry &= ((sqlite3_uint64)1<<nShift) - 1;
+
+      /* Offset tables hold where each block starts, size tables how
+      ** large each block is */
+      if( szEntry==8 ){
+        if( i==0 ){
+          if( (sqlite3_int64)iEntry!=iOfst ) return SQLITE_CORRUPT;
+          continue;
+        }
+        nByte = (sqlite3_int64)iEntry - iOfst;
+      }else{
+        nByte = (sqlite3_int64)iEntry;
+      }
+      if( nByte<0 || nByte>nComp || iOfst+nByte>iDataEnd ){
+        return SQLITE_CORRUPT;
+      }
+      vfstraceIndexSet(&p->idx, szEntry==8 ? i-1 : i, iOfst);
+      iOfst += nByte;
+    }
+  }
+  if( p->idx.aMap==0 ) vfstraceIndexSet(&p->idx, p->nBlock, iOfst);
+
+  /* Legacy files do not record the uncompressed size.  Every block is
+  ** full except possibly the last, so uncompress that one to find out. */
+  if( p->szDb<0 ){
+    size_t nLast;
+    i = p->nBlock - 1;
+    rc = vfstraceReadBlock(p, i, p->aBlock, &nLast);
+    if( rc!=SQLITE_OK ) return rc;
+    p->szDb = i * p->iBlockSize + nLast;
+  }
+
+  /* The page size tells the pinned tier where pages start in a block */
+  if( p->mxPin>0 && p->iEnd>p->iFirst ){
+    sqlite3_int64 iData;
+    size_t nData;
+    rc = vfstraceResolve(p, p->iFirst, &iData);
+    if( rc==SQLITE_OK ) rc = vfstraceReadBlock(p, iData, p->aBlock, &nData);
+    if( rc!=SQLITE_OK ) return rc;
+    if( nData>=100 && memcmp(p->aBlock, "SQLite format 3", 16)==0 ){
+      p->szPage = ((unsigned char)p->aBlock[16]<<8)
+                | (unsigned char)p->aBlock[17];
+      if( p->szPage==1 ) p->szPage = 65536;
+    }
+  }
+
+  if( p->mxCache>0 ){
+    sqlite3_int64 nEntry = p->mxCache / p->iBlockSize;
+    p->nHash = 64;
+    while( p->nHash<nEntry && p->nHash<(1<<24) ) p->nHash *= 2;
+    p->apHash = sqlite3_malloc64(p->nHash * sizeof(p->apHash[0]));
+    p->apFill = sqlite3_malloc64((p->nPrefetch+1) * sizeof(p->apFill[0]));
+    if( p->apHash==0 || p->apFill==0 ) return SQLITE_NOMEM;
+    memset(p->apHash, 0, p->nHash * sizeof(p->apHash[0]));
+    szScratch += p->nHash * sizeof(p->apHash[0])
+               + (p->nPrefetch+1) * sizeof(p->apFill[0]);
+  }
+
+  return vfstraceAttach(p, szScratch);
+}
+
+/*
+** Uncompress the nComp bytes at zComp, which hold block iBlock, into
+** zOut.  zOut must have room for a whole block.  The uncompressed length
+** is written to *pnOut.
+*/
+static int vfstraceUncompress(
+  vfstrace_file *p,
+  sqlite3_int64 iBlock,
+  const char *zComp,
+  int nComp,
+  char *zOut,
+  size_t *pnOut
+){
+  size_t nOut = p->iBlockSize;
+
+  switch( vfstraceCodec(p, iBlock) ){
+    case VFSTRACE_CODEC_SNAPPY: {
+      if( p->bVerify
+       && snappy_validate_compressed_buffer(zComp, nComp)!=SNAPPY_OK ){
+        return SQLITE_CORRUPT;
+      }
+      if( snappy_uncompress(zComp, nComp, zOut, &nOut)!=SNAPPY_OK ){
+        return SQLITE_CORRUPT;
+      }
+      break;
+    }
+    case VFSTRACE_CODEC_LZO: {
+      lzo_uint nLzo = nOut;
+      if( lzo1x_decompress_safe((const unsigned char*)zComp, nComp,
+                                (unsigned char*)zOut, &nLzo, 0)!=LZO_E_OK ){
+        return SQLITE_CORRUPT;
+      }
+      nOut = nLzo;
+      break;
+    }
+    case VFSTRACE_CODEC_RAW: {
+      if( nComp>p->iBlockSize ) return SQLITE_CORRUPT;
+      memcpy(zOut, zComp, nComp);
+      nOut = nComp;
+      break;
+    }
+    case VFSTRACE_CODEC_HOLE: {
+      if( nComp!=0 ) return SQLITE_CORRUPT;
+      memset(zOut, 0, p->iBlockSize);
+      break;
+    }
+    default: {
+      return SQLITE_CORRUPT;
+    }
+  }
+  /* Only the final block may be short */
+  if( p->bVerify && iBlock<p->nBlock-1 && nOut!=(size_t)p->iBlockSize ){
+    return SQLITE_CORRUPT;
+  }
+  *pnOut = nOut;
+  return SQLITE_OK;
+}
+
+/*
+** Uncompress block iBlock into zOut, which must have room for a whole
+** block.  The uncompressed length is written to *pnOut.
+*/
+static int vfstraceReadBlock(
+  vfstrace_file *p,
+  sqlite3_int64 iBlock,
+  char *zOut,
+  size_t *pnOut
+){
+  sqlite3_int64 iOfst = vfstraceIndexGet(&p->idx, iBlock);
+  sqlite3_int64 nComp = vfstraceIndexGet(&p->idx, iBlock+1) - iOfst;
+  int rc;
+
+  if( nComp<0 || nComp>p->mxComp ) return SQLITE_CORRUPT;
+  rc = p->pReal->pMethods->xRead(p->pReal, p->aComp, (int)nComp, iOfst);
+  if( rc==SQLITE_IOERR_SHORT_READ ) return SQLITE_CORRUPT;
+  if( rc!=SQLITE_OK ) return rc;
+  return vfstraceUncompress(p, iBlock, p->aComp, (int)nComp, zOut, pnOut);
+}
+
+/*
+** The block caches of every file opened through one VFS share the memory
+** budget in vfstrace_info.  Making room for one file may evict blocks
+** cached by another, so the vfstraceLru*() and vfstraceCache*() routines
+** must be called with vfstrace_info.pMutex held.
+*/
+
+/*
+** Unlink a cached block from the recently-used list.
+*/
+static void vfstraceLruUnlink(vfstrace_file *p, vfstrace_block *pBlock){
+  if( pBlock->pPrev ){
+    pBlock->pPrev->pNext = pBlock->pNext;
+  }else{
+    p->pMru = pBlock->pNext;
+  }
+  if( pBlock->pNext ){
+    pBlock->pNext->pPrev = pBlock->pPrev;
+  }else{
+    p->pLru = pBlock->pPrev;
+  }
+  pBlock->pPrev = pBlock->pNext = 0;
+}
+
+/*
+** Make a cached block the most recently used.
+*/
+static void vfstraceLruPush(vfstrace_file *p, vfstrace_block *pBlock){
+  pBlock->pPrev = 0;
+  pBlock->pNext = p->pMru;
+  if( p->pMru ) p->pMru->pPrev = pBlock;
+  p->pMru = pBlock;
+  if( p->pLru==0 ) p->pLru = pBlock;
+}
+
+/*
+** Return the cached copy of block iBlock, or NULL if it is not cached.
+*/
+static vfstrace_block *vfstraceCacheLookup(
+  vfstrace_file *p,
+  sqlite3_int64 iBlock
+){
+  vfstrace_block *pBlock = p->apHash[iBlock & (p->nHash-1)];
+  while( pBlock && pBlock->iBlock!=iBlock ) pBlock = pBlock->pHashNext;
+  return pBlock;
+}
+
+/*
+** Remove a block from the cache hash table and recently-used list, but
+** do not free it.  Its memory is still charged to the file.
+*/
+static void vfstraceCacheRemove(vfstrace_file *p, vfstrace_block *pBlock){
+  vfstrace_block **pp = &p->apHash[pBlock->iBlock & (p->nHash-1)];
+  while( *pp!=pBlock ) pp = &(*pp)->pHashNext;
+  *pp = pBlock->pHashNext;
+  vfstraceLruUnlink(p, pBlock);
+}
+
+/*
+** Map the arena that holds cached blocks once a budget says how large
+** it must be.  Cached blocks are scattered across a cache of many GiB and
+** looked up at random, so the arena asks for transparent huge pages to
+** cut TLB misses, and lays blocks out in fixed slots of szSlot bytes.
+** The slot size is taken from the first file to cache a block; files
+** with a different block size, and any blocks beyond the arena, come
+** from the heap instead.  If huge pages or the mapping are unavailable
+** the arena uses normal pages or is skipped altogether.
+*/
+static void vfstraceArenaInit(vfstrace_info *pInfo, int szSlot){
+#ifdef VFSTRACE_USE_MMAP
+  const sqlite3_int64 szHuge = 2*1024*1024;
+  sqlite3_int64 nSlot = pInfo->szBudget / szSlot;
+  sqlite3_int64 szArena = (nSlot*szSlot + szHuge-1) & ~(szHuge-1);
+  char *pMap;
+
+  pInfo->bArenaFailed = 1;
+  if( nSlot<=0 || nSlot>0x7fffffff ) return;
+  pInfo->aSlot = sqlite3_malloc64(nSlot * sizeof(pInfo->aSlot[0]));
+  if( pInfo->aSlot==0 ) return;
+
+  /* Over-allocate by one huge page so that the arena can start on a huge
+  ** page boundary. Only pages that are touched are ever backed. */
+  pMap = mmap(0, szArena+szHuge, PROT_READ|PROT_WRITE,
+              MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  if( pMap==MAP_FAILED ){
+    sqlite3_free(pInfo->aSlot);
+    pInfo->aSlot = 0;
+    return;
+  }
+  pInfo->pArenaMap = pMap;
+  pInfo->szArenaMap = szArena+szHuge;
+  pInfo->aArena = (char*)(((sqlite3_uint64)pMap + szHuge-1) & ~(szHuge-1));
+#ifdef MADV_HUGEPAGE
+  madvise(pInfo->aArena, szArena, MADV_HUGEPAGE);
+#endif
+  pInfo->szSlot = szSlot;
+  pInfo->nSlot = (int)nSlot;
+  pInfo->nSlotUsed = 0;
+  pInfo->pFreeSlot = 0;
+  pInfo->bArenaFailed = 0;
+#else
+  pInfo->bArenaFailed = 1;
+#endif
+}
+
+/*
+** Return a free arena slot for a block of p, or NULL if the arena does
+** not exist, is full, or has slots of a different size.
+*/
+static vfstrace_block *vfstraceArenaAlloc(vfstrace_file *p){
+  vfstrace_info *pInfo = p->pInfo;
+  vfstrace_block *pBlock;
+
+  if( pInfo->aArena==0 ){
+    if( pInfo->szBudget==0 || pInfo->bArenaFailed ) return 0;
+    vfstraceArenaInit(pInfo, p->iBlockSize);
+    if( pInfo->aArena==0 ) return 0;
+  }
+  if( pInfo->szSlot!=p->iBlockSize ) return 0;
+
+  if( pInfo->pFreeSlot ){
+    pBlock = pInfo->pFreeSlot;
+    pInfo->pFreeSlot = pBlock->pHashNext;
+  }else if( pInfo->nSlotUsed<pInfo->nSlot ){
+    pBlock = &pInfo->aSlot[pInfo->nSlotUsed];
+    pBlock->aData = &pInfo->aArena[(sqlite3_int64)pInfo->nSlotUsed
+                                   * pInfo->szSlot];
+    pInfo->nSlotUsed++;
+  }else{
+    return 0;
+  }
+  return pBlock;
+}
+
+/*
+** Free a cache entry that is not in the cache, and give its memory back
+** to the budget.
+*/
+static void vfstraceCacheFree(vfstrace_file *p, vfstrace_block *pBlock){
+  vfstrace_info *pInfo = p->pInfo;
+  if( pBlock->isPinned ){
+    p->szPin -= p->iBlockSize;
+    p->szCache += p->iBlockSize;
+    pBlock->isPinned = 0;
+  }
+  if( pBlock>=pInfo->aSlot && pBlock<&pInfo->aSlot[pInfo->nSlotUsed] ){
+    pBlock->pHashNext = pInfo->pFreeSlot;
+    pInfo->pFreeSlot = pBlock;
+  }else{
+    sqlite3_free(pBlock);
+  }
+  p->szCache -= p->iBlockSize;
+  p->pInfo->szUsed -= p->iBlockSize;
+}
+
+/*
+** Return the file that should give up a cached block to make room in
+** the shared budget, or NULL if no file has anything cached.  Files are
+** charged in proportion to their weight, so the victim is the file whose
+** cache is largest relative to its weight.
+*/
+static vfstrace_file *vfstraceCacheVictim(vfstrace_info *pInfo){
+  vfstrace_file *pVictim = 0;
+  vfstrace_file *pFile;
+  for(pFile=pInfo->pFiles; pFile; pFile=pFile->pNextFile){
+    if( pFile->pLru==0 ) continue;
+    if( pVictim==0
+     || pFile->szCache*pVictim->nWeight > pVictim->szCache*pFile->nWeight ){
+      pVictim = pFile;
+    }
+  }
+  return pVictim;
+}
+
+/*
+** Evict cached blocks, from whichever files are most over their share,
+** until nByte more bytes fit within the budget.  Return SQLITE_NOMEM if
+** that is not possible.
+*/
+static int vfstraceCacheShrink(vfstrace_info *pInfo, sqlite3_int64 nByte){
+  while( pInfo->szBudget>0 && pInfo->szUsed+nByte>pInfo->szBudget ){
+    vfstrace_file *pVictim = vfstraceCacheVictim(pInfo);
+    vfstrace_block *pBlock;
+    if( pVictim==0 ) return SQLITE_NOMEM;
+    pBlock = pVictim->pLru;
+    vfstraceCacheRemove(pVictim, pBlock);
+    vfstraceCacheFree(pVictim, pBlock);
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Return an unused cache entry, or NULL if the budget cannot spare one.
+** A file at its own cache_mb limit reuses its least recently used block;
+** otherwise room is made in the shared budget.
+*/
+static vfstrace_block *vfstraceCacheAlloc(vfstrace_file *p){
+  vfstrace_info *pInfo = p->pInfo;
+  vfstrace_block *pBlock;
+
+  if( p->szCache+p->iBlockSize>p->mxCache ){
+    pBlock = p->pLru;
+    if( pBlock ) vfstraceCacheRemove(p, pBlock);
+    return pBlock;
+  }
+  if( vfstraceCacheShrink(pInfo, p->iBlockSize)!=SQLITE_OK ) return 0;
+  pBlock = vfstraceArenaAlloc(p);
+  if( pBlock==0 ){
+    pBlock = sqlite3_malloc64(sizeof(*pBlock) + p->iBlockSize);
+    if( pBlock ) pBlock->aData = (char*)&pBlock[1];
+  }
+  if( pBlock ){
+    pBlock->isPinned = 0;
+    p->szCache += p->iBlockSize;
+    pInfo->szUsed += p->iBlockSize;
+  }
+  return pBlock;
+}
+
+/*
+** Return true if pBlock holds page 1, or the start of an interior b-tree
+** page (page type 0x02 or 0x05).  Those pages are read by nearly every
+** lookup, so they belong in the pinned tier where a large scan through
+** the LRU cannot evict them.
+*/
+static int vfstraceWantPin(vfstrace_file *p, vfstrace_block *pBlock){
+  sqlite3_int64 iOfst = (pBlock->iBlock - p->iFirst) * p->iBlockSize;
+  int i;
+
+  if( pBlock->iBlock==p->iFirst ) return 1;
+  if( p->szPage==0 ) return 0;
+
+  /* Offset of the first page that starts within this block */
+  i = (int)((p->szPage - iOfst % p->szPage) % p->szPage);
+  for(; i<pBlock->nData; i+=p->szPage){
+    if( pBlock->aData[i]==0x02 || pBlock->aData[i]==0x05 ) return 1;
+  }
+  return 0;
+}
+
+/*
+** Add pBlock, whose iBlock and data are already filled in, to the cache.
+** If bPin is true and the pinned tier has room, the block is pinned and
+** will stay cached until the file is closed.
+*/
+static void vfstraceCacheInsert(
+  vfstrace_file *p,
+  vfstrace_block *pBlock,
+  int bPin
+){
+  vfstrace_block **pp = &p->apHash[pBlock->iBlock & (p->nHash-1)];
+  pBlock->pHashNext = *pp;
+  *pp = pBlock;
+  if( bPin && p->szPin+p->iBlockSize<=p->mxPin ){
+    pBlock->isPinned = 1;
+    pBlock->pPrev = 0;
+    pBlock->pNext = p->pPinned;
+    p->pPinned = pBlock;
+    p->szPin += p->iBlockSize;
+    p->szCache -= p->iBlockSize;
+  }else{
+    vfstraceLruPush(p, pBlock);
+  }
+}
+
+/*
+** Free every cached block.
+*/
+static void vfstraceCacheClear(vfstrace_file *p){
+  while( p->pLru ){
+    vfstrace_block *pBlock = p->pLru;
+    vfstraceCacheRemove(p, pBlock);
+    vfstraceCacheFree(p, pBlock);
+  }
+  while( p->pPinned ){
+    vfstrace_block *pBlock = p->pPinned;
+    p->pPinned = pBlock->pNext;
+    vfstraceCacheFree(p, pBlock);
+  }
+  memset(p->apHash, 0, p->nHash * sizeof(p->apHash[0]));
+}
+
+/*
+** Charge szScratch bytes of index and buffers to the budget and add p to
+** the list of open files.  Fail with SQLITE_NOMEM if even evicting every
+** cached block would not make room.
+*/
+static int vfstraceAttach(vfstrace_file *p, sqlite3_int64 szScratch){
+  vfstrace_info *pInfo = p->pInfo;
+  int rc;
+  sqlite3_mutex_enter(pInfo->pMutex);
+  rc = vfstraceCacheShrink(pInfo, szScratch);
+  if( rc==SQLITE_OK ){
+    p->szScratch = szScratch;
+    pInfo->szUsed += szScratch;
+    p->pNextFile = pInfo->pFiles;
+    pInfo->pFiles = p;
+  }
+  sqlite3_mutex_leave(pInfo->pMutex);
+  return rc;
+}
+
+/*
+** Undo vfstraceAttach() and release everything p has cached.
+*/
+static void vfstraceDetach(vfstrace_file *p){
+  vfstrace_info *pInfo = p->pInfo;
+  vfstrace_file **pp;
+  sqlite3_mutex_enter(pInfo->pMutex);
+  for(pp=&pInfo->pFiles; *pp; pp=&(*pp)->pNextFile){
+    if( *pp==p ){
+      *pp = p->pNextFile;
+      break;
+    }
+  }
+  if( p->apHash ) vfstraceCacheClear(p);
+  pInfo->szUsed -= p->szScratch;
+  p->szScratch = 0;
+  sqlite3_mutex_leave(pInfo->pMutex);
+}
+
+/*
+** Copy up to nAmt bytes of block iBlock, starting iSkip bytes into the
+** block, to zOut.  The uncompressed length of the block is written to
+** *pnData.
+**
+** Cache hits are served under the VFS mutex.  On a miss, entries for the
+** block and up to nPrefetch following uncached blocks are reserved, the
+** blocks are read with a single read of the underlying file and
+** uncompressed outside the mutex, and then added to the cache.  If the
+** budget cannot spare an entry the block is read without caching it.
+*/
+static int vfstraceFetchBlock(
+  vfstrace_file *p,
+  sqlite3_int64 iBlock,
+  int iSkip,
+  char *zOut,
+  int nAmt,
+  size_t *pnData
+){
+  vfstrace_info *pInfo = p->pInfo;
+  vfstrace_block *pBlock;
+  const char *zData;
+  int nFill = 0;
+  int i, rc;
+
+  if( p->apHash ){
+    sqlite3_mutex_enter(pInfo->pMutex);
+    pBlock = vfstraceCacheLookup(p, iBlock);
+    if( pBlock ){
+      if( !pBlock->isPinned && pBlock!=p->pMru ){
+        vfstraceLruUnlink(p, pBlock);
+        vfstraceLruPush(p, pBlock);
+      }
+      *pnData = pBlock->nData;
+      if( pBlock->nData>iSkip ){
+        memcpy(zOut, pBlock->aData + iSkip,
+               pBlock->nData-iSkip<nAmt ? pBlock->nData-iSkip : nAmt);
+      }
+      sqlite3_mutex_leave(pInfo->pMutex);
+      return SQLITE_OK;
+    }
+    while( iBlock+nFill<p->iEnd && nFill<=p->nPrefetch ){
+      if( nFill>0 && vfstraceCacheLookup(p, iBlock+nFill) ) break;
+      if( nFill>0 && vfstraceCodec(p, iBlock+nFill)>=VFSTRACE_CODEC_HOLE ){
+        break;
+      }
+      if( (p->apFill[nFill] = vfstraceCacheAlloc(p))==0 ) break;
+      nFill++;
+    }
+    sqlite3_mutex_leave(pInfo->pMutex);
+  }
+
+  if( nFill==0 ){
+    rc = vfstraceReadBlock(p, iBlock, p->aBlock, pnData);
+    zData = p->aBlock;
+  }else{
+    sqlite3_int64 iStart = vfstraceIndexGet(&p->idx, iBlock);
+    sqlite3_int64 iEnd = iStart;
+    sqlite3_int64 nComp = vfstraceIndexGet(&p->idx, iBlock+nFill) - iStart;
+    if( nComp<0 || nComp>(sqlite3_int64)p->mxComp*nFill ){
+      rc = SQLITE_CORRUPT;
+    }else{
+      rc = p->pReal->pMethods->xRead(p->pReal, p->aComp, (int)nComp, iStart);
+      if( rc==SQLITE_IOERR_SHORT_READ ) rc = SQLITE_CORRUPT;
+    }
+    for(i=0; i<nFill && rc==SQLITE_OK; i++){
+      sqlite3_int64 iNext = vfstraceIndexGet(&p->idx, iBlock+i+1);
+      size_t nData;
+      pBlock = p->apFill[i];
+      if( iNext<iEnd || iNext-iEnd>p->mxComp ){
+        rc = SQLITE_CORRUPT;
+        break;
+      }
+      rc = vfstraceUncompress(p, iBlock+i, &p->aComp[iEnd - iStart],
+               (int)(iNext - iEnd), pBlock->aData, &nData);
+      iEnd = iNext;
+      pBlock->iBlock = iBlock+i;
+      pBlock->nData = (int)nData;
+    }
+    *pnData = p->apFill[0]->nData;
+    zData = p->apFill[0]->aData;
+  }
+
+  if( rc==SQLITE_OK && *pnData>(size_t)iSkip ){
+    memcpy(zOut, zData + iSkip,
+           (int)*pnData-iSkip<nAmt ? (int)*pnData-iSkip : nAmt);
+  }
+
+  if( nFill>0 ){
+    sqlite3_mutex_enter(pInfo->pMutex);
+    for(i=0; i<nFill; i++){
+      if( rc==SQLITE_OK ){
+        pBlock = p->apFill[i];
+        vfstraceCacheInsert(p, pBlock,
+                            p->mxPin>0 && vfstraceWantPin(p, pBlock));
+      }else{
+        vfstraceCacheFree(p, p->apFill[i]);
+      }
+    }
+    sqlite3_mutex_leave(pInfo->pMutex);
+  }
+  return rc;
+}
+
+/*
+** Set *piData to the block whose stored bytes hold the contents of block
+** iBlock.  That is iBlock itself unless it is a VFSTRACE_CODEC_REF, which
+** must name an earlier block that is stored in full.
+*/
+static int vfstraceResolve(
+  vfstrace_file *p,
+  sqlite3_int64 iBlock,
+  sqlite3_int64 *piData
+){
+  sqlite3_int64 iOfst;
+  unsigned char aRef[8];
+  int rc;
+
+  *piData = iBlock;
+  if( vfstraceCodec(p, iBlock)!=VFSTRACE_CODEC_REF ) return SQLITE_OK;
+  iOfst = vfstraceIndexGet(&p->idx, iBlock);
+  if( vfstraceIndexGet(&p->idx, iBlock+1)-iOfst!=sizeof(aRef) ){
+    return SQLITE_CORRUPT;
+  }
+  rc = p->pReal->pMethods->xRead(p->pReal, aRef, sizeof(aRef), iOfst);
+  if( rc==SQLITE_IOERR_SHORT_READ ) return SQLITE_CORRUPT;
+  if( rc!=SQLITE_OK ) return rc;
+  *piData = (sqlite3_int64)vfstraceGet64(aRef);
+  if( *piData<0 || *piData>=iBlock
+   || vfstraceCodec(p, *piData)>=VFSTRACE_CODEC_HOLE ){
+    return SQLITE_CORRUPT;
+  }
+  return SQLITE_OK;
+}
 
 /*
 ** Close an vfstrace-file.
 */
 static int vfstraceClose(sqlite3_file *pFile){
   vfstrace_file *p = (vfstrace_file *)pFile;
-  vfstrace_info *pInfo = p->pInfo;
-  return p->pReal->pMethods->xClose(p->pReal);
+  int rc = p->pReal->pMethods->xClose(p->pReal);
+  sqlite3_free_filename(p->zArchive);
+  p->zArchive = 0;
+  vfstraceDetach(p);
+  sqlite3_free(p->apHash);
+  sqlite3_free(p->apFill);
+  vfstraceIndexFree(&p->idx);
+  sqlite3_free(p->aCodec);
+  sqlite3_free(p->aComp);
+  sqlite3_free((void*)pFile->pMethods);
+  pFile->pMethods = 0;
+  return rc;
 }
 
 /*
@@ -197,54 +1479,64 @@ static int vfstraceRead(
   sqlite_int64 iOfst
 ){
   vfstrace_file *p = (vfstrace_file *)pFile;
-  vfstrace_info *pInfo = p->pInfo;
-
-  int buf_size = 4096;
-  sqlite_int64 index[];
-  char * zBufPtr = (char *) zBuf;
-  int block = (iOfst / buf_size);
-  char tmp[ block_len ];
-
-  while (iAmt > 0) {
-    sqlite_int64 realOfst = index[block];
-    int block_len = index[block + 1] - index[block];
-
-    int rc = p->pReal->pMethods->xRead(p->pReal, tmp, block_len, realOfst);
-    if (rc != SQLITE_OK) {
-      return rc;
-    }
+  char *zBufPtr = (char *)zBuf;
+  int nPast = 0;                    /* Bytes asked for past the end */
 
-    size_t zBufAmt;
+  if( p->aComp==0 ){
+    return p->pReal->pMethods->xRead(p->pReal, zBuf, iAmt, iOfst);
+  }
 
-    if (iAmt < buf_size) {
-      // The calle's buffer doesn't have enough space, so we decompress into our own space
-      // and copy back
-      char tmp2[ buf_size ];
-      zBufAmt = buf_size;
+  /* The last block of a database in an archive is padded, so reads stop
+  ** at the database's size rather than where the blocks run out */
+  if( iOfst+iAmt>p->szDb ){
+    nPast = iOfst>=p->szDb ? iAmt : (int)(iOfst+iAmt-p->szDb);
+    iAmt -= nPast;
+  }
 
-      snappy_status status = snappy_uncompress(tmp, block_len, tmp2, &zBufAmt);
-      if (status != SNAPPY_OK || zBufAmt != buf_size) {
-        return SQLITE_CORRUPT;
-      }
+  while( iAmt>0 ){
+    sqlite3_int64 iBlock = p->iFirst + iOfst / p->iBlockSize;
+    int iSkip = (int)(iOfst % p->iBlockSize);
+    sqlite3_int64 iData;            /* Block holding iBlock's contents */
+    size_t nData;
+    int n, rc;
 
-      zBufAmt = iAmt;
-      memcpy(zBufPtr, tmp2, iAmt);
-    } else {
-      // Uncompress directly into calle's buffer
-      zBufAmt = iAmt;
-      snappy_status status = snappy_uncompress(tmp, block_len, zBufPtr, &zBufAmt);
+    if( iBlock>=p->iEnd ) break;
+    rc = vfstraceResolve(p, iBlock, &iData);
+    if( rc!=SQLITE_OK ) return rc;
 
-      if (status != SNAPPY_OK || zBufAmt != buf_size) {
-        return SQLITE_CORRUPT;
-      }
+    if( vfstraceCodec(p, iBlock)==VFSTRACE_CODEC_HOLE ){
+      // Nothing to read or cache, the block is all zeros
+      nData = p->iBlockSize;
+      n = p->iBlockSize - iSkip;
+      if( n>iAmt ) n = iAmt;
+      memset(zBufPtr, 0, n);
+    }else if( p->apHash==0 && iSkip==0 && iAmt>=p->iBlockSize ){
+      // Uncompress directly into caller's buffer
+      rc = vfstraceReadBlock(p, iData, zBufPtr, &nData);
+      if( rc!=SQLITE_OK ) return rc;
+      n = (int)nData;
+    }else{
+      // The block is cached, or the caller only wants part of it, so we
+      // uncompress into our own space and copy back
+      rc = vfstraceFetchBlock(p, iData, iSkip, zBufPtr, iAmt, &nData);
+      if( rc!=SQLITE_OK ) return rc;
+      n = (int)nData - iSkip;
+      if( n<=0 ) break;
+      if( n>iAmt ) n = iAmt;
     }
 
-    zBufPtr += zBufAmt;
-    iAmt    -= zBufAmt;
+    zBufPtr += n;
+    iOfst   += n;
+    iAmt    -= n;
 
-    block++;
+    if( nData<(size_t)p->iBlockSize ) break;  /* Short final block */
   }
 
+  iAmt += nPast;
+  if( iAmt>0 ){
+    memset(zBufPtr, 0, iAmt);
+    return SQLITE_IOERR_SHORT_READ;
+  }
   return SQLITE_OK;
 }
 
@@ -257,14 +1549,18 @@ static int vfstraceWrite(
   int iAmt, 
   sqlite_int64 iOfst
 ){
-  return SQLITE_READONLY;
+  vfstrace_file *p = (vfstrace_file *)pFile;
+  if( p->aComp ) return SQLITE_READONLY;
+  return p->pReal->pMethods->xWrite(p->pReal, zBuf, iAmt, iOfst);
 }
 
 /*
 ** Truncate an vfstrace-file.
 */
 static int vfstraceTruncate(sqlite3_file *pFile, sqlite_int64 size){
-  return SQLITE_READONLY;
+  vfstrace_file *p = (vfstrace_file *)pFile;
+  if( p->aComp ) return SQLITE_READONLY;
+  return p->pReal->pMethods->xTruncate(p->pReal, size);
 }
 
 /*
@@ -272,7 +1568,6 @@ static int vfstraceTruncate(sqlite3_file *pFile, sqlite_int64 size){
 */
 static int vfstraceSync(sqlite3_file *pFile, int flags){
   vfstrace_file *p = (vfstrace_file *)pFile;
-  vfstrace_info *pInfo = p->pInfo;
   return p->pReal->pMethods->xSync(p->pReal, flags);
 }
 
@@ -281,7 +1576,10 @@ static int vfstraceSync(sqlite3_file *pFile, int flags){
 */
 static int vfstraceFileSize(sqlite3_file *pFile, sqlite_int64 *pSize){
   vfstrace_file *p = (vfstrace_file *)pFile;
-  vfstrace_info *pInfo = p->pInfo;
+  if( p->aComp ){
+    *pSize = p->szDb;
+    return SQLITE_OK;
+  }
   return p->pReal->pMethods->xFileSize(p->pReal, pSize);
 }
 
@@ -290,7 +1588,6 @@ static int vfstraceFileSize(sqlite3_file *pFile, sqlite_int64 *pSize){
 */
 static int vfstraceLock(sqlite3_file *pFile, int eLock){
   vfstrace_file *p = (vfstrace_file *)pFile;
-  vfstrace_info *pInfo = p->pInfo;
   return p->pReal->pMethods->xLock(p->pReal, eLock);
 }
 
@@ -299,7 +1596,6 @@ static int vfstraceLock(sqlite3_file *pFile, int eLock){
 */
 static int vfstraceUnlock(sqlite3_file *pFile, int eLock){
   vfstrace_file *p = (vfstrace_file *)pFile;
-  vfstrace_info *pInfo = p->pInfo;
   return p->pReal->pMethods->xUnlock(p->pReal, eLock);
 }
 
@@ -308,7 +1604,6 @@ static int vfstraceUnlock(sqlite3_file *pFile, int eLock){
 */
 static int vfstraceCheckReservedLock(sqlite3_file *pFile, int *pResOut){
   vfstrace_file *p = (vfstrace_file *)pFile;
-  vfstrace_info *pInfo = p->pInfo;
   return p->pReal->pMethods->xCheckReservedLock(p->pReal, pResOut);
 }
 
@@ -317,7 +1612,6 @@ static int vfstraceCheckReservedLock(sqlite3_file *pFile, int *pResOut){
 */
 static int vfstraceFileControl(sqlite3_file *pFile, int op, void *pArg){
   vfstrace_file *p = (vfstrace_file *)pFile;
-  vfstrace_info *pInfo = p->pInfo;
   return p->pReal->pMethods->xFileControl(p->pReal, op, pArg);
 }
 
@@ -326,7 +1620,6 @@ static int vfstraceFileControl(sqlite3_file *pFile, int op, void *pArg){
 */
 static int vfstraceSectorSize(sqlite3_file *pFile){
   vfstrace_file *p = (vfstrace_file *)pFile;
-  vfstrace_info *pInfo = p->pInfo;
   return p->pReal->pMethods->xSectorSize(p->pReal);
 }
 
@@ -335,7 +1628,6 @@ static int vfstraceSectorSize(sqlite3_file *pFile){
 */
 static int vfstraceDeviceCharacteristics(sqlite3_file *pFile){
   vfstrace_file *p = (vfstrace_file *)pFile;
-  vfstrace_info *pInfo = p->pInfo;
   return p->pReal->pMethods->xDeviceCharacteristics(p->pReal);
 }
 
@@ -345,7 +1637,6 @@ static int vfstraceDeviceCharacteristics(sqlite3_file *pFile){
 */
 static int vfstraceShmLock(sqlite3_file *pFile, int ofst, int n, int flags){
   vfstrace_file *p = (vfstrace_file *)pFile;
-  vfstrace_info *pInfo = p->pInfo;
   return p->pReal->pMethods->xShmLock(p->pReal, ofst, n, flags);
 }
 static int vfstraceShmMap(
@@ -356,17 +1647,14 @@ static int vfstraceShmMap(
   void volatile **pp
 ){
   vfstrace_file *p = (vfstrace_file *)pFile;
-  vfstrace_info *pInfo = p->pInfo;
   return p->pReal->pMethods->xShmMap(p->pReal, iRegion, szRegion, isWrite, pp);
 }
 static void vfstraceShmBarrier(sqlite3_file *pFile){
   vfstrace_file *p = (vfstrace_file *)pFile;
-  vfstrace_info *pInfo = p->pInfo;
   p->pReal->pMethods->xShmBarrier(p->pReal);
 }
 static int vfstraceShmUnmap(sqlite3_file *pFile, int delFlag){
   vfstrace_file *p = (vfstrace_file *)pFile;
-  vfstrace_info *pInfo = p->pInfo;
   return p->pReal->pMethods->xShmUnmap(p->pReal, delFlag);
 }
 
@@ -374,6 +1662,25 @@ static int vfstraceShmUnmap(sqlite3_file *pFile, int delFlag){
 
 /*
 ** Open an vfstrace file handle.
+**
+** Main database files are compressed, and are always opened read-only.
+** Journals and temporary files are passed straight through to the
+** underlying VFS.
+**
+** The defaults given to the VFS can be overridden per database with URI
+** parameters:
+**
+**   cache_mb=N     Cache up to N MiB of uncompressed blocks.  0 disables
+**                  the cache.
+**   prefetch=N     On a cache miss, also read up to N following blocks.
+**   verify=BOOL    Validate each compressed block before uncompressing.
+**   pin_mb=N       Keep up to N MiB of blocks holding page 1 or interior
+**                  b-tree pages in a pinned tier that the LRU never
+**                  evicts.  The pinned tier is charged to the budget but
+**                  is not counted against cache_mb.  0 disables it.
+**   cache_weight=N Relative share of the VFS memory budget.  When the
+**                  budget is exhausted, blocks are evicted from the file
+**                  with the most cached per unit of weight.  Default 1.
 */
 static int vfstraceOpen(
   sqlite3_vfs *pVfs,
@@ -386,17 +1693,49 @@ static int vfstraceOpen(
   vfstrace_file *p = (vfstrace_file *)pFile;
   vfstrace_info *pInfo = (vfstrace_info*)pVfs->pAppData;
   sqlite3_vfs *pRoot = pInfo->pRootVfs;
+  memset(p, 0, sizeof(*p));
   p->pInfo = pInfo;
   p->zFName = zName ? fileTail(zName) : "<temp>";
   p->pReal = (sqlite3_file *)&p[1];
-  rc = pRoot->xOpen(pRoot, zName, p->pReal, flags, pOutFlags);
-  vfstrace_printf(pInfo, "%s.xOpen(%s,flags=0x%x)",
-                  pInfo->zVfsName, p->zFName, flags);
+  if( flags & SQLITE_OPEN_MAIN_DB ){
+    flags &= ~(SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE);
+    flags |= SQLITE_OPEN_READONLY;
+    p->mxCache = sqlite3_uri_int64(zName, "cache_mb", pInfo->szCache>>20);
+    p->mxCache = p->mxCache>0 ? p->mxCache<<20 : 0;
+    p->nPrefetch = (int)sqlite3_uri_int64(zName, "prefetch", pInfo->nPrefetch);
+    if( p->nPrefetch<0 || p->mxCache==0 ) p->nPrefetch = 0;
+    if( p->nPrefetch>1024 ) p->nPrefetch = 1024;
+    p->bVerify = sqlite3_uri_boolean(zName, "verify", pInfo->bVerify);
+    p->mxPin = sqlite3_uri_int64(zName, "pin_mb", pInfo->szPin>>20);
+    p->mxPin = p->mxPin>0 && p->mxCache>0 ? p->mxPin<<20 : 0;
+    p->nWeight = (int)sqlite3_uri_int64(zName, "cache_weight", 1);
+    if( p->nWeight<1 ) p->nWeight = 1;
+
+    /* A database in an archive is read from the archive file */
+    if( vfstraceArchiveSplit(zName)>0 ){
+      char *zArchive = sqlite3_mprintf("%.*s", vfstraceArchiveSplit(zName),
+                                       zName);
+      p->zMember = &zName[vfstraceArchiveSplit(zName)+1];
+      p->zArchive = zArchive ?
+          (char*)sqlite3_create_filename(zArchive, "", "", 0, 0) : 0;
+      sqlite3_free(zArchive);
+      if( p->zArchive==0 ) return SQLITE_NOMEM;
+    }
+  }
+  rc = pRoot->xOpen(pRoot, p->zArchive ? p->zArchive : zName, p->pReal,
+                    flags, pOutFlags);
   if( p->pReal->pMethods ){
     sqlite3_io_methods *pNew = sqlite3_malloc( sizeof(*pNew) );
     const sqlite3_io_methods *pSub = p->pReal->pMethods;
+    if( pNew==0 ){
+      pSub->xClose(p->pReal);
+      sqlite3_free_filename(p->zArchive);
+      return SQLITE_NOMEM;
+    }
     memset(pNew, 0, sizeof(*pNew));
-    pNew->iVersion = pSub->iVersion;
+    /* Version 3 adds xFetch/xUnfetch, which would hand SQLite a memory
+    ** map of the compressed bytes. */
+    pNew->iVersion = pSub->iVersion>2 ? 2 : pSub->iVersion;
     pNew->xClose = vfstraceClose;
     pNew->xRead = vfstraceRead;
     pNew->xWrite = vfstraceWrite;
@@ -416,13 +1755,17 @@ static int vfstraceOpen(
       pNew->xShmUnmap = pSub->xShmUnmap ? vfstraceShmUnmap : 0;
     }
     pFile->pMethods = pNew;
-  }
-  vfstrace_print_errcode(pInfo, " -> %s", rc);
-  if( pOutFlags ){
-    vfstrace_printf(pInfo, ", outFlags=0x%x\n", *pOutFlags);
+
+    if( rc==SQLITE_OK && (flags & SQLITE_OPEN_MAIN_DB) ){
+      rc = vfstraceLoadIndex(p, p->zArchive ? p->zArchive : zName);
+      if( rc!=SQLITE_OK ) vfstraceClose(pFile);
+    }
   }else{
-    vfstrace_printf(pInfo, "\n");
+    sqlite3_free_filename(p->zArchive);
+    p->zArchive = 0;
   }
+  vfstrace_printf(pInfo, "%s.xOpen(%s,flags=0x%x) -> %d\n",
+                  pInfo->zVfsName, p->zFName, flags, rc);
   return rc;
 }
 
@@ -465,7 +1808,22 @@ static int vfstraceFullPathname(
 ){
   vfstrace_info *pInfo = (vfstrace_info*)pVfs->pAppData;
   sqlite3_vfs *pRoot = pInfo->pRootVfs;
-  return pRoot->xFullPathname(pRoot, zPath, nOut, zOut);
+  int nArchive = vfstraceArchiveSplit(zPath);
+  char *zArchive;
+  int n, rc;
+
+  /* The root VFS would look for the database inside the archive as if it
+  ** were a directory, so only the archive's path is made canonical */
+  if( nArchive==0 ) return pRoot->xFullPathname(pRoot, zPath, nOut, zOut);
+  zArchive = sqlite3_mprintf("%.*s", nArchive, zPath);
+  if( zArchive==0 ) return SQLITE_NOMEM;
+  rc = pRoot->xFullPathname(pRoot, zArchive, nOut, zOut);
+  sqlite3_free(zArchive);
+  if( (rc & 0xff)!=SQLITE_OK ) return rc;     /* Or SQLITE_OK_SYMLINK */
+  n = (int)strlen(zOut);
+  if( n+(int)strlen(&zPath[nArchive])>=nOut ) return SQLITE_CANTOPEN;
+  memcpy(&zOut[n], &zPath[nArchive], strlen(&zPath[nArchive])+1);
+  return rc;
 }
 
 /*
@@ -598,9 +1956,11 @@ int vfstrace_register(
   vfstrace_info *pInfo;
   int nName;
   int nByte;
+  int rc;
 
   pRoot = sqlite3_vfs_find(zOldVfsName);
   if( pRoot==0 ) return SQLITE_NOTFOUND;
+  if( lzo_init()!=LZO_E_OK ) return SQLITE_ERROR;
 
   nName = strlen(zTraceName);
   nByte = sizeof(*pNew) + sizeof(*pInfo) + nName + 1;
@@ -645,5 +2005,171 @@ int vfstrace_register(
   pInfo->pOutArg   = pOutArg;
   pInfo->zVfsName  = pNew->zName;
   pInfo->pTraceVfs = pNew;
-  return sqlite3_vfs_register(pNew, makeDefault);
+  pInfo->szCache   = 16<<20;
+  pInfo->nPrefetch = 0;
+  pInfo->bVerify   = 1;
+  pInfo->szPin     = 4<<20;
+  pInfo->szBudget  = 0;
+  pInfo->pMutex    = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+  rc = sqlite3_vfs_register(pNew, makeDefault);
+  if( rc!=SQLITE_OK ){
+    sqlite3_mutex_free(pInfo->pMutex);
+    sqlite3_free(pNew);
+  }
+  return rc;
+}
+
+/*
+** Limit the memory used by the caches, indexes and buffers of every file
+** opened through the VFS named zVfsName to nByte bytes in total.  Zero
+** removes the limit.  Cached blocks are evicted straight away if the
+** VFS is already over the new limit.
+**
+** The first budget also sizes the arena that cached blocks are laid out
+** in.  The arena is never resized, so if a later budget is larger than
+** the first the extra blocks are allocated from the heap.
+**
+** Return SQLITE_OK on success, or SQLITE_NOTFOUND if zVfsName is not a
+** VFS created by vfstrace_register().
+*/
+int vfstrace_set_budget(const char *zVfsName, sqlite3_int64 nByte){
+  sqlite3_vfs *pVfs = sqlite3_vfs_find(zVfsName);
+  vfstrace_info *pInfo;
+  if( pVfs==0 || pVfs->xOpen!=vfstraceOpen ) return SQLITE_NOTFOUND;
+  pInfo = (vfstrace_info*)pVfs->pAppData;
+  sqlite3_mutex_enter(pInfo->pMutex);
+  pInfo->szBudget = nByte>0 ? nByte : 0;
+  vfstraceCacheShrink(pInfo, 0);
+  sqlite3_mutex_leave(pInfo->pMutex);
+  return SQLITE_OK;
+}
+
+/*
+** Register a VFS described by an init string of the form
+** "key=value&key=value", the same shape as a URI query string.  A NULL
+** or empty string registers the VFS with its defaults.  Recognized keys:
+**
+**   name=NAME      Name of the new VFS.  Default "snappy".
+**   root=NAME      Name of the underlying VFS.  Default is the current
+**                  default VFS.
+**   default=0|1    Make the new VFS the default.  Default 0.
+**   trace=0|1      Write trace output to stderr.  Default 0.
+**   cache_mb=N     Default block cache size of each database, in MiB.
+**   prefetch=N     Default number of blocks read ahead on a cache miss.
+**   verify=0|1     Default for validating blocks before uncompressing.
+**   pin_mb=N       Default size of the pinned tier of each database.
+**   budget_mb=N    Memory limit shared by all files opened through the
+**                  VFS.  See vfstrace_set_budget().  Default unlimited.
+**                  Setting a budget also backs the caches with an arena
+**                  of huge pages sized to match.
+**
+** cache_mb, prefetch, verify and pin_mb are the defaults for the URI
+** parameters of the same name accepted by vfstraceOpen().
+**
+** Registering a name that is already held by this VFS only updates its
+** settings, so that loading the extension twice is safe.
+**
+** Return SQLITE_OK on success, SQLITE_ERROR for an unknown key, or any
+** error returned by vfstrace_register().
+*/
+int vfstrace_register_config(const char *zConfig){
+  char *zCopy;
+  char *z;
+  const char *zName = "snappy";
+  const char *zRoot = 0;
+  int makeDefault = 0;
+  int bTrace = 0;
+  sqlite3_int64 szCache = -1;
+  int nPrefetch = -1;
+  int bVerify = -1;
+  sqlite3_int64 szPin = -1;
+  sqlite3_int64 szBudget = -1;
+  sqlite3_vfs *pOld;
+  int rc = SQLITE_OK;
+
+  zCopy = sqlite3_mprintf("%s", zConfig ? zConfig : "");
+  if( zCopy==0 ) return SQLITE_NOMEM;
+
+  for(z=zCopy; *z && rc==SQLITE_OK; ){
+    char *zKey = z;
+    char *zVal = "";
+    while( *z && *z!='&' ) z++;
+    if( *z ) *z++ = 0;
+    if( (zVal = strchr(zKey, '='))!=0 ){
+      *zVal++ = 0;
+    }else{
+      zVal = "1";
+    }
+    if( strcmp(zKey, "name")==0 ){
+      zName = zVal;
+    }else if( strcmp(zKey, "root")==0 ){
+      zRoot = zVal[0] ? zVal : 0;
+    }else if( strcmp(zKey, "default")==0 ){
+      makeDefault = atoi(zVal);
+    }else if( strcmp(zKey, "trace")==0 ){
+      bTrace = atoi(zVal);
+    }else if( strcmp(zKey, "cache_mb")==0 ){
+      szCache = (sqlite3_int64)atoi(zVal) << 20;
+    }else if( strcmp(zKey, "prefetch")==0 ){
+      nPrefetch = atoi(zVal);
+    }else if( strcmp(zKey, "verify")==0 ){
+      bVerify = atoi(zVal)!=0;
+    }else if( strcmp(zKey, "pin_mb")==0 ){
+      szPin = (sqlite3_int64)atoi(zVal) << 20;
+    }else if( strcmp(zKey, "budget_mb")==0 ){
+      szBudget = (sqlite3_int64)atoi(zVal) << 20;
+    }else if( zKey[0] ){
+      rc = SQLITE_ERROR;
+    }
+  }
+
+  if( rc==SQLITE_OK ){
+    pOld = sqlite3_vfs_find(zName);
+    if( pOld && pOld->xOpen==vfstraceOpen ){
+      rc = makeDefault ? sqlite3_vfs_register(pOld, 1) : SQLITE_OK;
+    }else{
+      rc = vfstrace_register(zName, zRoot,
+               bTrace ? (int(*)(const char*,void*))fputs : 0, stderr,
+               makeDefault);
+    }
+  }
+
+  if( rc==SQLITE_OK ){
+    vfstrace_info *pInfo = (vfstrace_info*)sqlite3_vfs_find(zName)->pAppData;
+    if( szCache>=0 ) pInfo->szCache = szCache;
+    if( nPrefetch>=0 ) pInfo->nPrefetch = nPrefetch;
+    if( bVerify>=0 ) pInfo->bVerify = bVerify;
+    if( szPin>=0 ) pInfo->szPin = szPin;
+    if( szBudget>=0 ) rc = vfstrace_set_budget(zName, szBudget);
+  }
+  sqlite3_free(zCopy);
+  return rc;
+}
+
+#ifndef SQLITE_CORE
+/*
+** Entry point used when this file is built as a loadable extension.  The
+** VFS is configured from the VFS_SNAPPY_CONFIG environment variable, and
+** stays registered after the connection that loaded it is closed.
+*/
+#ifdef _WIN32
+__declspec(dllexport)
+#endif
+int sqlite3_extension_init(
+  sqlite3 *db,
+  char **pzErrMsg,
+  const sqlite3_api_routines *pApi
+){
+  int rc;
+  (void)db;
+  SQLITE_EXTENSION_INIT2(pApi);
+  rc = vfstrace_register_config(getenv("VFS_SNAPPY_CONFIG"));
+  if( rc!=SQLITE_OK ){
+    *pzErrMsg = sqlite3_mprintf("cannot register snappy VFS from \"%s\": %s",
+                                getenv("VFS_SNAPPY_CONFIG"),
+                                sqlite3_errstr(rc));
+    return rc;
+  }
+  return SQLITE_OK_LOAD_PERMANENTLY;
 }
+#endif /* SQLITE_CORE */
@@ -0,0 +1,211 @@
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include <stdint.h>
+
+#include "format.h"
+#include "codecs.h"
+
+using namespace std;
+
+
+/**
+ * Measures each codec at each block size over a corpus of files, printing
+ * one CSV row per combination: the ratio, compression and decompression
+ * throughput, and the median and 99th percentile time to decode a single
+ * block, which is what a query waiting on a cache miss sees.
+ *
+ * Runs on one thread so the numbers are per core. Each pass is repeated
+ * and the fastest kept, to keep noise from other processes out.
+ */
+
+typedef chrono::steady_clock bench_clock;
+
+static double seconds_since(bench_clock::time_point start) {
+	return chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// Split a comma separated list
+static vector<string> split(const string & s) {
+	vector<string> out;
+	stringstream ss(s);
+	string item;
+	while (getline(ss, item, ','))
+		out.push_back(item);
+	return out;
+}
+
+struct block {
+	const char * raw;
+	size_t raw_len;
+	size_t out_offset;    // Where its compressed form is in the output buffer
+	size_t out_len;
+};
+
+/**
+ * Bench one codec at one block size, printing its row. Returns false if a
+ * block fails to round trip.
+ */
+static bool bench(const string & name, size_t block_size, const vector<string> & corpus, unsigned repeat) {
+	Compressor * compressor = new_compressor(name);
+
+	// Blocks don't span files, as they wouldn't span databases
+	vector<block> blocks;
+	size_t out_max = 0, raw_total = 0;
+	for (size_t f = 0; f < corpus.size(); f++) {
+		for (size_t pos = 0; pos < corpus[f].size(); pos += block_size) {
+			block b;
+			b.raw = corpus[f].data() + pos;
+			b.raw_len = min(block_size, corpus[f].size() - pos);
+			b.out_offset = out_max;
+			b.out_len = 0;
+			blocks.push_back(b);
+			out_max += compressor->max_compressed_length(b.raw_len);
+			raw_total += b.raw_len;
+		}
+	}
+	vector<char> out(out_max);
+	vector<char> scratch(block_size);
+
+	double compress_secs = 0;
+	for (unsigned r = 0; r < repeat; r++) {
+		bench_clock::time_point start = bench_clock::now();
+		for (size_t i = 0; i < blocks.size(); i++)
+			blocks[i].out_len = compressor->compress(blocks[i].raw, blocks[i].raw_len, &out[blocks[i].out_offset]);
+		double secs = seconds_since(start);
+		compress_secs = r == 0 ? secs : min(compress_secs, secs);
+	}
+	size_t out_total = 0;
+	for (size_t i = 0; i < blocks.size(); i++)
+		out_total += blocks[i].out_len;
+
+	// Check every block comes back as it went in
+	for (size_t i = 0; i < blocks.size(); i++) {
+		const block & b = blocks[i];
+		if (!decompress(compressor->codec(), &out[b.out_offset], b.out_len, &scratch[0], b.raw_len)
+		 || memcmp(&scratch[0], b.raw, b.raw_len) != 0) {
+			cerr << name << " at " << block_size << " failed to round trip block " << i << endl;
+			delete compressor;
+			return false;
+		}
+	}
+
+	// Throughput over whole passes, as the clock costs too much per block
+	double decompress_secs = 0;
+	for (unsigned r = 0; r < repeat; r++) {
+		bench_clock::time_point start = bench_clock::now();
+		for (size_t i = 0; i < blocks.size(); i++) {
+			const block & b = blocks[i];
+			decompress(compressor->codec(), &out[b.out_offset], b.out_len, &scratch[0], b.raw_len);
+		}
+		double secs = seconds_since(start);
+		decompress_secs = r == 0 ? secs : min(decompress_secs, secs);
+	}
+
+	// Then latency one block at a time
+	vector<double> latency;
+	latency.reserve(blocks.size() * repeat);
+	for (unsigned r = 0; r < repeat; r++) {
+		for (size_t i = 0; i < blocks.size(); i++) {
+			const block & b = blocks[i];
+			bench_clock::time_point start = bench_clock::now();
+			decompress(compressor->codec(), &out[b.out_offset], b.out_len, &scratch[0], b.raw_len);
+			latency.push_back(seconds_since(start) * 1e6);
+		}
+	}
+	sort(latency.begin(), latency.end());
+	double p50 = latency.empty() ? 0 : latency[latency.size() / 2];
+	double p99 = latency.empty() ? 0 : latency[min(latency.size() - 1, latency.size() * 99 / 100)];
+
+	cout << name << "," << block_size << "," << blocks.size() << ","
+	     << raw_total << "," << out_total << ","
+	     << ((double) raw_total / out_total) << ","
+	     << (raw_total / compress_secs / 1e6) << ","
+	     << (raw_total / decompress_secs / 1e6) << ","
+	     << p50 << "," << p99 << endl;
+
+	delete compressor;
+	return true;
+}
+
+void usage(const char * argv0) {
+	cerr << "Usage: " << argv0 << " [--codecs=C,...] [--block-sizes=N,...] [--repeat=R] {file} ..." << endl
+	     << "  C is one of snappy, lzo, lzo999 or raw, default all of them" << endl
+	     << "  N is the uncompressed bytes per block, default 1024,4096,16384,65536" << endl
+	     << "  R is how many times each pass is run, default 3" << endl;
+}
+
+int main(int argc, const char *argv[]) {
+	vector<string> codecs;
+	for (int i = 0; compressor_names[i] != NULL; i++)
+		codecs.push_back(compressor_names[i]);
+	vector<string> block_sizes = split("1024,4096,16384,65536");
+	unsigned repeat = 3;
+
+	int arg = 1;
+	for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+		const char * eq = strchr(argv[arg], '=');
+		string opt = eq ? string(argv[arg] + 2, eq) : "";
+		if (opt == "codecs") {
+			codecs = split(eq + 1);
+		} else if (opt == "block-sizes") {
+			block_sizes = split(eq + 1);
+		} else if (opt == "repeat") {
+			repeat = strtoul(eq + 1, NULL, 10);
+		} else {
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if (arg == argc || repeat == 0) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	for (size_t i = 0; i < codecs.size(); i++) {
+		Compressor * check = new_compressor(codecs[i]);
+		if (check == NULL) {
+			cerr << "Unknown codec: " << codecs[i] << endl;
+			return -1;
+		}
+		delete check;
+	}
+	for (size_t i = 0; i < block_sizes.size(); i++) {
+		size_t n = strtoul(block_sizes[i].c_str(), NULL, 10);
+		if (n == 0 || n > MAX_BLOCK_SIZE) {
+			cerr << "Block size must be between 1 and " << MAX_BLOCK_SIZE << endl;
+			return -1;
+		}
+	}
+
+	if (lzo_init() != LZO_E_OK) {
+		cerr << "Failed to init LZO" << endl;
+		return -1;
+	}
+
+	vector<string> corpus;
+	for (; arg < argc; arg++) {
+		ifstream in(argv[arg], ios::binary | ios::in);
+		if (!in) {
+			cerr << "Failed to open corpus file: " << argv[arg] << endl;
+			return -1;
+		}
+		corpus.push_back(string(istreambuf_iterator<char>(in), istreambuf_iterator<char>()));
+	}
+
+	cout << "codec,block_size,blocks,raw_bytes,compressed_bytes,ratio,"
+	     << "compress_mb_s,decompress_mb_s,decode_p50_us,decode_p99_us" << endl;
+	for (size_t c = 0; c < codecs.size(); c++) {
+		for (size_t b = 0; b < block_sizes.size(); b++) {
+			if (!bench(codecs[c], strtoul(block_sizes[b].c_str(), NULL, 10), corpus, repeat))
+				return -1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,222 @@
+#ifndef ZSQLITE_CODECS_H
+#define ZSQLITE_CODECS_H
+
+#include <string>
+#include <iostream>
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+
+#include <assert.h>
+
+#include <snappy.h>
+
+#include <lzo/lzoconf.h>
+#include <lzo/lzo1x.h>
+
+#include "format.h"
+
+class Compressor {
+
+public:
+	virtual ~Compressor() {}
+
+	// The codec written to the index for blocks from this compressor
+	virtual enum codec codec() const = 0;
+
+	// Worst case output of compress() for len bytes of input
+	virtual size_t max_compressed_length(size_t len) const = 0;
+
+	// Compress len bytes at in into out, which has room for at least
+	// max_compressed_length(len) bytes. Returns the compressed length.
+	virtual size_t compress(const char * in, size_t len, char * out) = 0;
+};
+
+class SnappyCompressor : public Compressor {
+
+public:
+	SnappyCompressor() {}
+
+	enum codec codec() const { return CODEC_SNAPPY; }
+
+	size_t max_compressed_length(size_t len) const {
+		return snappy::MaxCompressedLength(len);
+	}
+
+	size_t compress(const char * in, size_t len, char * out) {
+		size_t out_len;
+		snappy::RawCompress(in, len, out, &out_len);
+
+		#ifdef PARANOID
+		assert( snappy::IsValidCompressedBuffer(out, out_len) );
+		#endif
+		return out_len;
+	}
+};
+
+/**
+ * LZO1X at level 1 (fast) or 999 (best ratio, same decompression speed)
+ * TODO Test LZO1F
+ */
+class LZOCompressor : public Compressor {
+
+	char * wrkmem;
+	int level;
+
+public:
+	LZOCompressor(int level = 1) : level(level) {
+		if (lzo_init() != LZO_E_OK) {
+			std::cerr << "Failed to init LZO" << std::endl;
+			throw new std::runtime_error("Failed to init LZO");
+		}
+
+		this->wrkmem = new char[level == 1 ? LZO1X_1_MEM_COMPRESS : LZO1X_999_MEM_COMPRESS];
+	}
+
+	~LZOCompressor() {
+		delete[] this->wrkmem;
+	}
+
+	enum codec codec() const { return CODEC_LZO; }
+
+	size_t max_compressed_length(size_t len) const {
+		return len + len / 16 + 64 + 3;
+	}
+
+	size_t compress(const char * in, size_t len, char * out) {
+		lzo_uint out_len = max_compressed_length(len);
+
+		int r;
+		if (level == 1) {
+			r = lzo1x_1_compress(
+				(const unsigned char *) in, len,
+				(unsigned char *) out, &out_len, wrkmem);
+		} else {
+			r = lzo1x_999_compress(
+				(const unsigned char *) in, len,
+				(unsigned char *) out, &out_len, wrkmem);
+		}
+		if (r != LZO_E_OK) {
+			printf("internal error - compression failed: %d\n", r);
+		}
+
+		return out_len;
+	}
+};
+
+/**
+ * Stores blocks as they are, for pages that must be read with no
+ * decompression cost at all.
+ */
+class RawCompressor : public Compressor {
+
+public:
+	enum codec codec() const { return CODEC_RAW; }
+
+	size_t max_compressed_length(size_t len) const {
+		return len;
+	}
+
+	size_t compress(const char * in, size_t len, char * out) {
+		memcpy(out, in, len);
+		return len;
+	}
+};
+
+// Every name new_compressor() knows, NULL terminated
+static const char * const compressor_names[] = { "snappy", "lzo", "lzo999", "raw", NULL };
+
+/**
+ * Returns a new compressor for a codec name given on the command line,
+ * or NULL if the name is unknown.
+ */
+static inline Compressor * new_compressor(const std::string & name) {
+	if (name == "snappy")
+		return new SnappyCompressor();
+	if (name == "lzo")
+		return new LZOCompressor(1);
+	if (name == "lzo999")
+		return new LZOCompressor(999);
+	if (name == "raw")
+		return new RawCompressor();
+	return NULL;
+}
+
+/**
+ * Entropy of the bytes at in, in bits per byte from 0 to 8, for telling
+ * blocks that can't compress from those worth trying. This is the collision
+ * (Renyi order 2) entropy of the byte histogram, which is never more than
+ * the Shannon entropy, so a block it puts over a threshold is over it by
+ * either measure. It needs one log per block rather than one per byte
+ * value, and the pair count makes it unbiased, so that even a short block
+ * of random bytes comes out near 8. Counts go into four histograms in turn
+ * so that runs of one value don't all wait on the same counter.
+ *
+ * Snappy and LZO only find repeats, so a block near 8 is almost always one
+ * they can't shrink: JPEG, zlib or encrypted data.
+ */
+static inline double byte_entropy(const char * in, size_t len) {
+	uint32_t counts[4][256];
+	memset(counts, 0, sizeof(counts));
+
+	const unsigned char * p = (const unsigned char *) in;
+	size_t i = 0;
+	for (; i + 4 <= len; i += 4) {
+		counts[0][p[i]]++;
+		counts[1][p[i + 1]]++;
+		counts[2][p[i + 2]]++;
+		counts[3][p[i + 3]]++;
+	}
+	for (; i < len; i++)
+		counts[0][p[i]]++;
+
+	// Pairs of bytes that are equal, out of all the pairs
+	uint64_t pairs = 0;
+	for (int b = 0; b < 256; b++) {
+		uint64_t n = counts[0][b] + counts[1][b] + counts[2][b] + counts[3][b];
+		pairs += n * (n - 1);
+	}
+	if (pairs == 0)
+		return len < 2 ? 0 : 8;
+
+	double bits = -std::log2((double) pairs / ((double) len * (len - 1)));
+	return std::min(bits, 8.0);
+}
+
+/**
+ * Decompress len bytes at in, written with codec, into out, which has room
+ * for raw_len bytes. Returns false unless it decompresses to exactly
+ * raw_len bytes. lzo_init() must have been called for CODEC_LZO. A
+ * CODEC_REF holds no data of its own; decompress the block it refers to.
+ */
+static inline bool decompress(enum codec codec, const char * in, size_t len, char * out, size_t raw_len) {
+	switch (codec) {
+	case CODEC_SNAPPY: {
+		size_t n;
+		return snappy::GetUncompressedLength(in, len, &n) && n == raw_len
+		    && snappy::RawUncompress(in, len, out);
+	}
+	case CODEC_LZO: {
+		lzo_uint n = raw_len;
+		return lzo1x_decompress_safe((const unsigned char *) in, len,
+		                             (unsigned char *) out, &n, NULL) == LZO_E_OK
+		    && n == raw_len;
+	}
+	case CODEC_RAW:
+		if (len != raw_len)
+			return false;
+		memcpy(out, in, len);
+		return true;
+	case CODEC_HOLE:
+		if (len != 0)
+			return false;
+		memset(out, 0, raw_len);
+		return true;
+	case CODEC_REF:
+		return false;
+	}
+	return false;
+}
+
+#endif
@@ -0,0 +1,483 @@
+#ifndef ZSQLITE_FORMAT_H
+#define ZSQLITE_FORMAT_H
+
+#include <string>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * On-disk format, version 1. Must match sqlite_vfs/vfs_snappy.c
+ *
+ *   header   FORMAT_HEADER_SIZE bytes, see struct header
+ *   index    block_count uint32_t entries, starting at index_offset
+ *   blocks   the compressed blocks back to back, starting at data_offset
+ *
+ * All integers are little-endian whatever the host. Each index entry holds
+ * the compressed length of a block in its low INDEX_CODEC_SHIFT bits and
+ * the codec used for the block in the bits above.
+ *
+ * With FLAG_OFFSET_INDEX the index instead holds block_count + 1 uint64_t
+ * entries, the absolute offset of each block in the low OFFSET_CODEC_SHIFT
+ * bits and its codec above, the last being the end of the final block. It
+ * starts and ends on an INDEX_ALIGN boundary so the VFS can mmap it as is.
+ *
+ * With FLAG_FOOTER_INDEX the file is written in one pass: the header has
+ * block_count, raw_size and index_offset zero, the index (either kind)
+ * follows the blocks, and a FORMAT_TRAILER_SIZE byte trailer ends the file:
+ *
+ *   0  char[8]  TRAILER_MAGIC
+ *   8  uint64   block_count
+ *  16  uint64   raw_size
+ *  24  uint64   index_offset
+ *
+ * A block of CODEC_HOLE has a compressed length of zero and reads as
+ * block_size zero bytes: it is a block that was all zeros, or held only
+ * freelist leaf pages, whose contents SQLite never reads. It is never the
+ * short final block.
+ *
+ * A block of CODEC_REF is a whole block identical to an earlier one, which
+ * is stored only once. Its REF_SIZE stored bytes are the uint64 number of
+ * that earlier block, which is never itself a hole or a reference.
+ *
+ * With FLAG_BLOCK_HASHES the index is directly followed by block_count
+ * uint64_t block_hash()es of the uncompressed blocks (for a hole, of the
+ * zeros it reads as), so a later run given this file as --base can tell
+ * which blocks have not changed. The VFS ignores them.
+ *
+ * With FLAG_DIRECTORY the file is an archive of several databases, each
+ * starting on a block boundary and zero padded to a whole block, so that
+ * references can share blocks between them. The hashes (or without them
+ * the index) are followed by a directory of the databases:
+ *
+ *   0  uint64  count of databases
+ *   8  uint64  bytes of entries that follow, each of
+ *              0   uint64  first block
+ *              8   uint64  raw_size of the database alone
+ *              16  uint32  length of its name
+ *              20  char[]  the name, with no NUL and no '/'
+ *
+ * The VFS opens a database in an archive by the archive's path and then
+ * its name, as "dir/all.zsq/05000.sqlite".
+ *
+ * Files written before version 1 start with two native ints (block size
+ * and block count) and a uint16_t index. The VFS reads only those written
+ * with per-class codecs, whose entries carry a codec above bit 13. Older
+ * ones have no codec bits and are all LZO1X, so they must be restored
+ * with the tool that wrote them and compressed again.
+ */
+const char     FORMAT_MAGIC[8]    = { 'z', 's', 'q', 'l', 'i', 't', 'e', '\0' };
+const uint32_t FORMAT_VERSION     = 1;
+const size_t   FORMAT_HEADER_SIZE = 64;
+
+enum codec {
+	CODEC_SNAPPY = 0,
+	CODEC_LZO    = 1, // Any LZO1X level, they share one decompressor
+	CODEC_RAW    = 2, // Stored uncompressed
+	CODEC_HOLE   = 3, // Nothing stored, a whole block of zeros
+	CODEC_REF    = 4, // Same as an earlier block, see below
+};
+
+const int      INDEX_CODEC_SHIFT = 28;
+const uint32_t INDEX_LEN_MASK    = (1 << INDEX_CODEC_SHIFT) - 1;
+
+const uint32_t FLAG_OFFSET_INDEX  = 0x0001;
+const uint32_t FLAG_FOOTER_INDEX  = 0x0002;
+const uint32_t FLAG_BLOCK_HASHES  = 0x0004;
+const uint32_t FLAG_DIRECTORY     = 0x0008;
+const int      OFFSET_CODEC_SHIFT = 60;
+const uint64_t INDEX_ALIGN        = 4096;
+
+const size_t   REF_SIZE          = 8;
+
+const char     TRAILER_MAGIC[8]    = { 'z', 's', 'q', 'l', 'e', 'n', 'd', '\0' };
+const size_t   FORMAT_TRAILER_SIZE = 32;
+
+// Largest block whose worst case compressed size fits in an index entry
+const uint32_t MAX_BLOCK_SIZE = 128 * 1024 * 1024;
+
+static inline void put_le32(char *p, uint32_t v) {
+	for (int i = 0; i < 4; i++)
+		p[i] = (char) (v >> (i * 8));
+}
+
+static inline void put_le64(char *p, uint64_t v) {
+	for (int i = 0; i < 8; i++)
+		p[i] = (char) (v >> (i * 8));
+}
+
+static inline uint32_t get_le32(const char *p) {
+	uint32_t v = 0;
+	for (int i = 3; i >= 0; i--)
+		v = (v << 8) | (unsigned char) p[i];
+	return v;
+}
+
+static inline uint64_t get_le64(const char *p) {
+	return get_le32(p) | ((uint64_t) get_le32(p + 4) << 32);
+}
+
+static inline uint64_t rotl64(uint64_t v, int r) {
+	return (v << r) | (v >> (64 - r));
+}
+
+/**
+ * 64-bit hash of an uncompressed block, to spot blocks that have not
+ * changed since the last run. This is the MurmurHash3 x64 mix over little-endian
+ * 8 byte words, which runs at several GB/s, far faster than any of the codecs.
+ */
+static inline uint64_t block_hash(const char * p, size_t len) {
+	const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+	uint64_t h = len * c1;
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		uint64_t k = get_le64(p + i);
+		h ^= rotl64(k * c1, 31) * c2;
+		h = rotl64(h, 27) * 5 + 0x52dce729;
+	}
+	if (i < len) {
+		uint64_t k = 0;
+		for (size_t j = len; j > i; j--)
+			k = (k << 8) | (unsigned char) p[j - 1];
+		h ^= rotl64(k * c1, 31) * c2;
+	}
+
+	// fmix64
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// A database in a FLAG_DIRECTORY archive
+struct archive_member {
+	std::string name;
+	uint64_t first_block;
+	uint64_t raw_size;
+
+	archive_member(const std::string & name, uint64_t first_block, uint64_t raw_size)
+		: name(name), first_block(first_block), raw_size(raw_size) {}
+};
+
+// Returns the on-disk directory of an archive
+static inline std::string encode_directory(const std::vector<archive_member> & members) {
+	std::string entries;
+	for (size_t i = 0; i < members.size(); i++) {
+		char fixed[20];
+		put_le64(fixed, members[i].first_block);
+		put_le64(fixed + 8, members[i].raw_size);
+		put_le32(fixed + 16, (uint32_t) members[i].name.size());
+		entries.append(fixed, sizeof(fixed));
+		entries.append(members[i].name);
+	}
+
+	char head[16];
+	put_le64(head, members.size());
+	put_le64(head + 8, entries.size());
+	return std::string(head, sizeof(head)) + entries;
+}
+
+struct header {
+	uint32_t block_size;
+	uint32_t flags;        // FLAG_* bits
+	uint64_t block_count;
+	uint64_t raw_size;     // Uncompressed length of the database
+	uint64_t index_offset;
+	uint64_t data_offset;
+	uint64_t directory_size; // Bytes of directory, with FLAG_DIRECTORY
+
+	// raw_size is ignored with FLAG_FOOTER_INDEX, which leaves block_count,
+	// raw_size and index_offset to be set once all the blocks are written
+	header(uint32_t block_size, uint64_t raw_size, uint32_t flags, uint64_t directory_size = 0)
+		: block_size(block_size), flags(flags), raw_size(raw_size), directory_size(directory_size) {
+		block_count  = (raw_size + block_size - 1) / block_size;
+		if (flags & FLAG_FOOTER_INDEX) {
+			block_count  = 0;
+			this->raw_size = 0;
+			index_offset = 0;
+			data_offset  = FORMAT_HEADER_SIZE;
+		} else if (flags & FLAG_OFFSET_INDEX) {
+			index_offset = INDEX_ALIGN;
+			data_offset  = index_offset + index_size() + hash_size() + directory_size;
+			data_offset  = (data_offset + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+		} else {
+			index_offset = FORMAT_HEADER_SIZE;
+			data_offset  = index_offset + index_size() + hash_size() + directory_size;
+		}
+	}
+
+	uint64_t index_size() const {
+		if (flags & FLAG_OFFSET_INDEX)
+			return (block_count + 1) * sizeof(uint64_t);
+		return block_count * sizeof(uint32_t);
+	}
+
+	uint64_t hash_size() const {
+		return (flags & FLAG_BLOCK_HASHES) ? block_count * sizeof(uint64_t) : 0;
+	}
+
+	// Writes the FORMAT_HEADER_SIZE byte on-disk form to out
+	void encode(char * out) const {
+		memset(out, 0, FORMAT_HEADER_SIZE);
+		memcpy(out, FORMAT_MAGIC, sizeof(FORMAT_MAGIC));
+		put_le32(out +  8, FORMAT_VERSION);
+		put_le32(out + 12, flags);
+		put_le32(out + 16, block_size);
+		if ((flags & FLAG_FOOTER_INDEX) == 0) {
+			put_le64(out + 24, block_count);
+			put_le64(out + 32, raw_size);
+			put_le64(out + 40, index_offset);
+		}
+		put_le64(out + 48, data_offset);
+	}
+
+	// Writes the FORMAT_TRAILER_SIZE byte trailer of a FLAG_FOOTER_INDEX file
+	void encode_trailer(char * out) const {
+		memcpy(out, TRAILER_MAGIC, sizeof(TRAILER_MAGIC));
+		put_le64(out +  8, block_count);
+		put_le64(out + 16, raw_size);
+		put_le64(out + 24, index_offset);
+	}
+
+	// Returns the on-disk index for blocks of the given sizes and codecs,
+	// the first block starting at data_offset
+	std::string encode_index(const std::vector<uint32_t> & index) const {
+		std::string out;
+		if (flags & FLAG_OFFSET_INDEX) {
+			out.resize((index.size() + 1) * sizeof(uint64_t));
+			uint64_t offset = data_offset;
+			for (size_t i = 0; i <= index.size(); i++) {
+				uint64_t codec = i < index.size() ? index[i] >> INDEX_CODEC_SHIFT : 0;
+				put_le64(&out[i * sizeof(uint64_t)], offset | (codec << OFFSET_CODEC_SHIFT));
+				if (i < index.size())
+					offset += index[i] & INDEX_LEN_MASK;
+			}
+		} else {
+			out.resize(index.size() * sizeof(uint32_t));
+			for (size_t i = 0; i < index.size(); i++)
+				put_le32(&out[i * sizeof(uint32_t)], index[i]);
+		}
+		return out;
+	}
+
+	// Returns the on-disk block hashes, empty without FLAG_BLOCK_HASHES
+	std::string encode_hashes(const std::vector<uint64_t> & hashes) const {
+		std::string out;
+		if (flags & FLAG_BLOCK_HASHES) {
+			out.resize(hashes.size() * sizeof(uint64_t));
+			for (size_t i = 0; i < hashes.size(); i++)
+				put_le64(&out[i * sizeof(uint64_t)], hashes[i]);
+		}
+		return out;
+	}
+
+	friend std::ostream& operator<< (std::ostream &, const struct header &);
+};
+
+/**
+ * A compressed file mapped read-only, with its header and index parsed, for
+ * the tools that read them back. Only version 1 files are understood; the
+ * VFS is the only reader of the older format.
+ */
+class CompressedFile {
+
+	const char * data;
+	uint64_t length;
+	uint32_t flags;
+	uint32_t block_size;
+	uint64_t block_count;
+	uint64_t raw_size;
+	std::vector<uint64_t> offsets;  // block_count + 1, where each block starts
+	std::vector<uint8_t> codecs;
+	const char * hashes;            // In the mapping, NULL if there are none
+	std::vector<archive_member> members; // Empty unless FLAG_DIRECTORY
+
+	CompressedFile(const CompressedFile &);
+	CompressedFile & operator= (const CompressedFile &);
+
+	bool corrupt(const char * path, const char * why) {
+		std::cerr << path << ": " << why << std::endl;
+		return false;
+	}
+
+	// Parse the directory between offset and end into members
+	bool read_directory(uint64_t offset, uint64_t end) {
+		if (offset + 16 > end || end > length)
+			return false;
+		uint64_t count = get_le64(data + offset);
+		uint64_t bytes = get_le64(data + offset + 8);
+		if (bytes > end - offset - 16)
+			return false;
+
+		const char * p = data + offset + 16, * stop = p + bytes;
+		for (uint64_t i = 0; i < count; i++) {
+			if (stop - p < 20)
+				return false;
+			uint64_t first = get_le64(p), size = get_le64(p + 8);
+			uint32_t name_len = get_le32(p + 16);
+			if ((uint64_t) (stop - p - 20) < name_len)
+				return false;
+			std::string name(p + 20, name_len);
+			if (name.empty() || name.find('/') != std::string::npos || first > block_count
+			 || size > (block_count - first) * block_size)
+				return false;
+			members.push_back(archive_member(name, first, size));
+			p += 20 + name_len;
+		}
+		return true;
+	}
+
+public:
+	CompressedFile() : data(NULL), length(0), flags(0), block_size(0),
+		block_count(0), raw_size(0), hashes(NULL) {}
+
+	~CompressedFile() {
+		if (data != NULL)
+			munmap((void *) data, length);
+	}
+
+	/**
+	 * Map and check the file at path. Returns false, having said why, if it
+	 * can't be read.
+	 */
+	bool open(const char * path) {
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0)
+			return corrupt(path, strerror(errno));
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+			close(fd);
+			return corrupt(path, "not a regular file");
+		}
+		length = st.st_size;
+		if (length < FORMAT_HEADER_SIZE) {
+			close(fd);
+			return corrupt(path, "too short to be a compressed file");
+		}
+		void * p = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED)
+			return corrupt(path, strerror(errno));
+		data = (const char *) p;
+
+		if (memcmp(data, FORMAT_MAGIC, sizeof(FORMAT_MAGIC)) != 0
+		 || get_le32(data + 8) != FORMAT_VERSION)
+			return corrupt(path, "not a version 1 compressed file");
+
+		flags = get_le32(data + 12);
+		header head(get_le32(data + 16), 0, flags);
+		head.block_count  = get_le64(data + 24);
+		head.raw_size     = get_le64(data + 32);
+		head.index_offset = get_le64(data + 40);
+		head.data_offset  = get_le64(data + 48);
+		uint64_t data_end = length;
+		if (flags & FLAG_FOOTER_INDEX) {
+			const char * trailer = data + length - FORMAT_TRAILER_SIZE;
+			if (length < FORMAT_HEADER_SIZE + FORMAT_TRAILER_SIZE
+			 || memcmp(trailer, TRAILER_MAGIC, sizeof(TRAILER_MAGIC)) != 0)
+				return corrupt(path, "missing trailer");
+			head.block_count  = get_le64(trailer + 8);
+			head.raw_size     = get_le64(trailer + 16);
+			head.index_offset = get_le64(trailer + 24);
+			data_end = head.index_offset;
+		}
+
+		if (head.block_size == 0 || head.block_size > MAX_BLOCK_SIZE
+		 || head.block_count != (head.raw_size + head.block_size - 1) / head.block_size)
+			return corrupt(path, "bad header");
+		if (head.index_offset > length || head.block_count > length
+		 || head.index_offset + head.index_size() + head.hash_size() > length
+		 || head.data_offset > data_end)
+			return corrupt(path, "index out of bounds");
+
+		block_size = head.block_size;
+		block_count = head.block_count;
+		raw_size = head.raw_size;
+		offsets.resize(block_count + 1);
+		codecs.resize(block_count);
+
+		const char * index = data + head.index_offset;
+		uint64_t offset = head.data_offset;
+		for (uint64_t i = 0; i <= block_count; i++) {
+			if (flags & FLAG_OFFSET_INDEX) {
+				uint64_t entry = get_le64(index + i * sizeof(uint64_t));
+				offset = entry & ((1ULL << OFFSET_CODEC_SHIFT) - 1);
+				if (i < block_count)
+					codecs[i] = (uint8_t) (entry >> OFFSET_CODEC_SHIFT);
+			}
+			offsets[i] = offset;
+			if (offset > data_end || (i > 0 && offset < offsets[i - 1]))
+				return corrupt(path, "index entry out of bounds");
+			if (i < block_count && (flags & FLAG_OFFSET_INDEX) == 0) {
+				uint32_t entry = get_le32(index + i * sizeof(uint32_t));
+				codecs[i] = (uint8_t) (entry >> INDEX_CODEC_SHIFT);
+				offset += entry & INDEX_LEN_MASK;
+			}
+		}
+		if (flags & FLAG_BLOCK_HASHES)
+			hashes = index + head.index_size();
+		if (flags & FLAG_DIRECTORY) {
+			uint64_t dir_offset = head.index_offset + head.index_size() + head.hash_size();
+			uint64_t dir_end = flags & FLAG_FOOTER_INDEX ? length - FORMAT_TRAILER_SIZE : head.data_offset;
+			if (!read_directory(dir_offset, dir_end))
+				return corrupt(path, "bad directory");
+		}
+		return true;
+	}
+
+	uint32_t get_flags() const { return flags; }
+	uint32_t get_block_size() const { return block_size; }
+	uint64_t get_block_count() const { return block_count; }
+	uint64_t get_raw_size() const { return raw_size; }
+	bool has_hashes() const { return hashes != NULL; }
+
+	// The databases in an archive, empty if this is not one
+	const std::vector<archive_member> & get_members() const { return members; }
+
+	// The compressed bytes of block i, setting len and codec
+	const char * get_block(uint64_t i, size_t & len, enum codec & codec) const {
+		len = offsets[i + 1] - offsets[i];
+		codec = (enum codec) codecs[i];
+		return data + offsets[i];
+	}
+
+	/**
+	 * The block whose stored bytes hold the contents of block i: i itself,
+	 * or the block a CODEC_REF refers to. Returns get_block_count() if the
+	 * reference is bad.
+	 */
+	uint64_t resolve(uint64_t i) const {
+		if (codecs[i] != CODEC_REF)
+			return i;
+		if (offsets[i + 1] - offsets[i] != REF_SIZE)
+			return block_count;
+		uint64_t target = get_le64(data + offsets[i]);
+		if (target >= i || codecs[target] == CODEC_REF || codecs[target] == CODEC_HOLE)
+			return block_count;
+		return target;
+	}
+
+	// Uncompressed length of block i, short only for the last
+	size_t get_raw_length(uint64_t i) const {
+		return (size_t) std::min<uint64_t>(block_size, raw_size - i * block_size);
+	}
+
+	// The block_hash() of block i, if has_hashes()
+	uint64_t get_hash(uint64_t i) const {
+		return get_le64(hashes + i * sizeof(uint64_t));
+	}
+};
+
+#endif
@@ -0,0 +1,354 @@
+#include <string>
+#include <iostream>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+using namespace std;
+
+
+/**
+ * Builds a SQLite database that looks like the census extracts this tool
+ * was written for, at whatever size a benchmark needs, so they can run
+ * anywhere without the real data. The same seed and size give the same
+ * rows every time.
+ *
+ *   geo        one row per geography: a text key, names, codes, indexed
+ *   estimates  a wide table of counts per geography, mostly small, often
+ *              zero or repeated, like the ACS summary tables
+ *   shapes     a boundary per geography as a blob of delta coded points
+ *   scratch    rows of which runs are deleted at the end, leaving free
+ *              pages behind as a database that has been edited would
+ *
+ * Rows are added a geography at a time until the file reaches the target
+ * size.
+ */
+
+const int ESTIMATE_COLUMNS = 48;
+
+/**
+ * splitmix64, so the data does not depend on the C library's rand()
+ */
+class Random {
+
+	uint64_t state;
+
+public:
+	Random(uint64_t seed) : state(seed) {}
+
+	uint64_t next() {
+		uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+
+	// Uniform in [0, n)
+	uint64_t below(uint64_t n) {
+		return next() % n;
+	}
+
+	// Mostly small, with a long tail, like population counts
+	int64_t skewed(int64_t max) {
+		int64_t v = (int64_t) below(max + 1);
+		return v * v / (max + 1);
+	}
+};
+
+static const char * const state_names[] = {
+	"Alabama", "Alaska", "Arizona", "Arkansas", "California", "Colorado",
+	"Connecticut", "Delaware", "Florida", "Georgia", "Hawaii", "Idaho",
+	"Illinois", "Indiana", "Iowa", "Kansas", "Kentucky", "Louisiana",
+	"Maine", "Maryland", "Massachusetts", "Michigan", "Minnesota",
+	"Mississippi", "Missouri", "Montana", "Nebraska", "Nevada",
+	"New Hampshire", "New Jersey", "New Mexico", "New York",
+	"North Carolina", "North Dakota", "Ohio", "Oklahoma", "Oregon",
+	"Pennsylvania", "Rhode Island", "South Carolina", "South Dakota",
+	"Tennessee", "Texas", "Utah", "Vermont", "Virginia", "Washington",
+	"West Virginia", "Wisconsin", "Wyoming"
+};
+const int STATES = sizeof(state_names) / sizeof(state_names[0]);
+
+static const char * const place_words[] = {
+	"Spring", "Oak", "Cedar", "Lake", "River", "Hill", "Green", "Fair",
+	"Mill", "Rock", "Pine", "Union", "Salem", "Franklin", "Clinton",
+	"Madison", "Jackson", "Marion", "Center", "Grove"
+};
+const int PLACE_WORDS = sizeof(place_words) / sizeof(place_words[0]);
+
+static const char * const place_kinds[] = {
+	"County", "city", "town", "village", "CDP", "borough", "township"
+};
+const int PLACE_KINDS = sizeof(place_kinds) / sizeof(place_kinds[0]);
+
+/**
+ * A database being generated, with its insert statements
+ */
+class Generator {
+
+	sqlite3 * db;
+	Random random;
+	sqlite3_stmt * geo;
+	sqlite3_stmt * estimates;
+	sqlite3_stmt * shapes;
+	sqlite3_stmt * scratch;
+	int64_t geographies;
+
+	bool exec(const char * sql) {
+		char * err = NULL;
+		if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+			cerr << "Failed to run \"" << sql << "\": " << err << endl;
+			sqlite3_free(err);
+			return false;
+		}
+		return true;
+	}
+
+	bool prepare(const char * sql, sqlite3_stmt ** stmt) {
+		if (sqlite3_prepare_v2(db, sql, -1, stmt, NULL) != SQLITE_OK) {
+			cerr << "Failed to prepare \"" << sql << "\": " << sqlite3_errmsg(db) << endl;
+			return false;
+		}
+		return true;
+	}
+
+	bool step(sqlite3_stmt * stmt) {
+		int rc = sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+		if (rc != SQLITE_DONE) {
+			cerr << "Failed to insert: " << sqlite3_errmsg(db) << endl;
+			return false;
+		}
+		return true;
+	}
+
+	// Add one geography and the rows that go with it
+	bool add_geography() {
+		int64_t id = geographies++;
+		int state = (int) (id % STATES) + 1;
+		int64_t county = id / STATES;
+		char key[32], name[96];
+
+		snprintf(key, sizeof(key), "05000US%02d%05lld", state, (long long) county);
+		snprintf(name, sizeof(name), "%s%s %s, %s",
+		         place_words[random.below(PLACE_WORDS)],
+		         random.below(3) == 0 ? "field" : "",
+		         place_kinds[random.below(PLACE_KINDS)], state_names[state - 1]);
+		int64_t population = 500 + random.skewed(2000000);
+
+		sqlite3_bind_text(geo, 1, key, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_text(geo, 2, name, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_int(geo, 3, state);
+		sqlite3_bind_int64(geo, 4, county);
+		sqlite3_bind_int64(geo, 5, population);
+		sqlite3_bind_double(geo, 6, 25.0 + random.below(2400000) / 100000.0);
+		sqlite3_bind_double(geo, 7, -125.0 + random.below(5800000) / 100000.0);
+		if (!step(geo))
+			return false;
+
+		// Counts are shares of the population, with many small and zero
+		// cells, and margins of error alongside some of them
+		sqlite3_bind_text(estimates, 1, key, -1, SQLITE_TRANSIENT);
+		for (int c = 0; c < ESTIMATE_COLUMNS; c++) {
+			int64_t v;
+			if (c % 8 == 7)
+				v = random.below(500);  // Margin of error
+			else if (random.below(4) == 0)
+				v = 0;
+			else
+				v = population * (int64_t) random.below(1000) / (1000 * (c + 1));
+			sqlite3_bind_int64(estimates, c + 2, v);
+		}
+		if (!step(estimates))
+			return false;
+
+		// A random walk of points, stored as little-endian 16-bit deltas
+		vector<char> blob(64 + random.below(16) * 256);
+		for (size_t i = 0; i < blob.size(); i += 2) {
+			uint16_t d = (uint16_t) ((int) random.below(201) - 100);
+			blob[i] = (char) d;
+			blob[i + 1] = (char) (d >> 8);
+		}
+		sqlite3_bind_text(shapes, 1, key, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_int(shapes, 2, (int) (blob.size() / 4));
+		sqlite3_bind_blob(shapes, 3, &blob[0], (int) blob.size(), SQLITE_TRANSIENT);
+		if (!step(shapes))
+			return false;
+
+		for (int i = 0; i < 4; i++) {
+			char note[160];
+			int len = 40 + (int) random.below(100);
+			for (int j = 0; j < len; j++)
+				note[j] = 'a' + (char) random.below(26);
+			sqlite3_bind_text(scratch, 1, note, len, SQLITE_TRANSIENT);
+			if (!step(scratch))
+				return false;
+		}
+		return true;
+	}
+
+public:
+	Generator(uint64_t seed) : db(NULL), random(seed), geo(NULL), estimates(NULL),
+		shapes(NULL), scratch(NULL), geographies(0) {}
+
+	~Generator() {
+		sqlite3_finalize(geo);
+		sqlite3_finalize(estimates);
+		sqlite3_finalize(shapes);
+		sqlite3_finalize(scratch);
+		sqlite3_close(db);
+	}
+
+	/**
+	 * Create the database at path, replacing any file there. Returns
+	 * false, having said why, on error.
+	 */
+	bool open(const char * path, int page_size) {
+		unlink(path);
+		if (sqlite3_open(path, &db) != SQLITE_OK) {
+			cerr << "Failed to create " << path << ": " << sqlite3_errmsg(db) << endl;
+			return false;
+		}
+
+		char pragma[64];
+		snprintf(pragma, sizeof(pragma), "PRAGMA page_size=%d", page_size);
+		string columns;
+		string params;
+		for (int c = 0; c < ESTIMATE_COLUMNS; c++) {
+			char column[32];
+			snprintf(column, sizeof(column), ", %s%03d INTEGER", c % 8 == 7 ? "m" : "e", c);
+			columns += column;
+			params += ", ?";
+		}
+
+		return exec(pragma)
+		    && exec("PRAGMA journal_mode=OFF")
+		    && exec("PRAGMA synchronous=OFF")
+		    && exec("PRAGMA cache_size=-262144")
+		    // Freed pages keep their rows, as they do by default upstream,
+		    // rather than the zeros of builds with SQLITE_SECURE_DELETE
+		    && exec("PRAGMA secure_delete=OFF")
+		    && exec("CREATE TABLE geo (geoid TEXT PRIMARY KEY, name TEXT, state INTEGER,"
+		            " county INTEGER, population INTEGER, lat REAL, lon REAL)")
+		    && exec("CREATE INDEX geo_name ON geo (name)")
+		    && exec(("CREATE TABLE estimates (geoid TEXT" + columns + ")").c_str())
+		    && exec("CREATE INDEX estimates_geoid ON estimates (geoid)")
+		    && exec("CREATE TABLE shapes (geoid TEXT, points INTEGER, boundary BLOB)")
+		    && exec("CREATE TABLE scratch (note TEXT)")
+		    && prepare("INSERT INTO geo VALUES (?, ?, ?, ?, ?, ?, ?)", &geo)
+		    && prepare(("INSERT INTO estimates VALUES (?" + params + ")").c_str(), &estimates)
+		    && prepare("INSERT INTO shapes VALUES (?, ?, ?)", &shapes)
+		    && prepare("INSERT INTO scratch VALUES (?)", &scratch);
+	}
+
+	/**
+	 * Add geographies until the database is about size bytes, then free
+	 * runs of scratch rows. Returns false on error.
+	 */
+	bool fill(uint64_t size, bool progress) {
+		if (!exec("BEGIN"))
+			return false;
+
+		for (;;) {
+			for (int i = 0; i < 1000; i++) {
+				if (!add_geography())
+					return false;
+			}
+
+			sqlite3_stmt * stmt;
+			if (!prepare("PRAGMA page_count", &stmt))
+				return false;
+			sqlite3_step(stmt);
+			uint64_t pages = sqlite3_column_int64(stmt, 0);
+			sqlite3_finalize(stmt);
+			if (!prepare("PRAGMA page_size", &stmt))
+				return false;
+			sqlite3_step(stmt);
+			uint64_t bytes = pages * sqlite3_column_int64(stmt, 0);
+			sqlite3_finalize(stmt);
+
+			if (progress)
+				cerr << "\r" << (bytes >> 20) << " MiB, " << geographies << " geographies" << flush;
+			if (bytes >= size)
+				break;
+
+			// Commit now and then to keep the page cache from growing
+			if (geographies % 100000 == 0 && !(exec("COMMIT") && exec("BEGIN")))
+				return false;
+		}
+		if (progress)
+			cerr << endl;
+
+		// Whole runs of rows, so whole pages are freed. The rows are on disk
+		// first, as freed pages are not written out again
+		return exec("COMMIT")
+		    && exec("DELETE FROM scratch WHERE (rowid / 256) % 3 = 0");
+	}
+
+	int64_t get_geographies() const { return geographies; }
+};
+
+// Parses sizes like 10M or 100G
+static uint64_t parse_size(const char * s) {
+	char * end;
+	uint64_t n = strtoull(s, &end, 10);
+	switch (*end) {
+	case 'k': case 'K': return n << 10;
+	case 'm': case 'M': return n << 20;
+	case 'g': case 'G': return n << 30;
+	case 't': case 'T': return n << 40;
+	case '\0': return n;
+	}
+	return 0;
+}
+
+void usage(const char * argv0) {
+	cerr << "Usage: " << argv0 << " [--size=N] [--seed=S] [--page-size=P] [--progress] {dest}" << endl
+	     << "  N is the size of the database, with an optional K, M, G or T suffix," << endl
+	     << "        default 64M" << endl
+	     << "  S seeds the data, the same seed giving the same rows, default 1" << endl
+	     << "  P is the SQLite page size, default 4096" << endl;
+}
+
+int main(int argc, const char *argv[]) {
+	uint64_t size = 64 << 20;
+	uint64_t seed = 1;
+	int page_size = 4096;
+	bool progress = false;
+
+	int arg = 1;
+	for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+		const char * eq = strchr(argv[arg], '=');
+		string opt = eq ? string(argv[arg] + 2, eq) : string(argv[arg] + 2);
+		if (eq && opt == "size") {
+			size = parse_size(eq + 1);
+		} else if (eq && opt == "seed") {
+			seed = strtoull(eq + 1, NULL, 10);
+		} else if (eq && opt == "page-size") {
+			page_size = atoi(eq + 1);
+		} else if (!eq && opt == "progress") {
+			progress = true;
+		} else {
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if (argc - arg != 1 || size == 0 || page_size < 512 || page_size > 65536
+	 || (page_size & (page_size - 1)) != 0) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	Generator gen(seed);
+	if (!gen.open(argv[arg], page_size) || !gen.fill(size, progress))
+		return -1;
+
+	cout << "Generated " << gen.get_geographies() << " geographies in " << argv[arg] << endl;
+	return 0;
+}
@@ -3,194 +3,1745 @@
 #include <iterator>
 #include <fstream>
 #include <vector>
+#include <map>
+#include <unordered_map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 #include <cerrno>
 #include <cstring>
 #include <stdexcept>
 
 #include <assert.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#include <snappy.h>
+#include <sqlite3.h>
 
-#include <lzo/lzoconf.h>
-#include <lzo/lzo1x.h>
+#include "format.h"
+#include "codecs.h"
 
 using namespace std;
-using namespace snappy;
 
 
-// function copied from snappy
-inline char* string_as_array(std::string * str) {
-	return str->empty() ? NULL : &*str->begin();
-}
+/**
+ * Where the pipeline reader gets uncompressed data from
+ */
+class Source {
 
-inline const char* string_as_array(const std::string * str) {
-	return str->empty() ? NULL : &*str->begin();
-}
+public:
+	virtual ~Source() {}
 
-struct header {
-	int block_size;
-	int index_len; // 16 Terabytes (compressed)
+	/**
+	 * Return up to len bytes of the next block, either in place or copied
+	 * into buf, which has room for len bytes. Sets n to the number of
+	 * bytes, 0 at the end. Returns NULL on error.
+	 */
+	virtual const char * read(char * buf, size_t len, size_t & n) = 0;
 
-	header(int block_size, int index_len)
-		: block_size(block_size), index_len(index_len) {}
+	// True if read() never copies into buf
+	virtual bool in_place() const { return false; }
 
-	friend ostream& operator<< (ostream &, const struct header &);
+	// Bytes in the whole source, or -1 if not known until the end
+	virtual int64_t size() const { return -1; }
 };
 
-streampos file_len(ifstream &s) {
-	s.seekg (0, ios::end);
-	return s.tellg();
+/**
+ * The whole source file mapped read-only, so blocks are compressed straight
+ * out of the page cache with no copy.
+ */
+class MappedFile : public Source {
+
+	const char * data;
+	uint64_t length;
+	uint64_t pos;
+
+	MappedFile(const MappedFile &);
+	MappedFile & operator= (const MappedFile &);
+
+public:
+	MappedFile() : data(NULL), length(0), pos(0) {}
+
+	~MappedFile() {
+		if (data != NULL)
+			munmap((void *) data, length);
+	}
+
+	/**
+	 * Map path. Returns false if it can't be mapped, for example because
+	 * it is a pipe; the caller can still read it as a stream.
+	 */
+	bool open(const char * path) {
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+			close(fd);
+			return false;
+		}
+		length = st.st_size;
+
+		if (length > 0) {
+			void * p = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p == MAP_FAILED) {
+				close(fd);
+				return false;
+			}
+			madvise(p, length, MADV_SEQUENTIAL);
+			data = (const char *) p;
+		}
+		close(fd);
+		return true;
+	}
+
+	const char * get_data() const { return data; }
+
+	const char * read(char *, size_t len, size_t & n) {
+		n = (size_t) min<uint64_t>(len, length - pos);
+		if (n == 0)
+			return ""; // At the end, or an empty file with nothing mapped
+		pos += n;
+		return data + pos - n;
+	}
+
+	bool in_place() const { return true; }
+	int64_t size() const { return length; }
+};
+
+/**
+ * A source that can't be mapped, such as stdin or a pipe
+ */
+class StreamSource : public Source {
+
+	istream & in;
+
+public:
+	StreamSource(istream & in) : in(in) {}
+
+	const char * read(char * buf, size_t len, size_t & n) {
+		n = 0;
+		if (!in.good())
+			return buf; // Already at the end
+		in.read(buf, len);
+		if (in.bad()) {
+			cerr << "Error while reading source " << in.rdstate() << endl;
+			return NULL;
+		}
+		n = in.gcount();
+		return buf;
+	}
+};
+
+/**
+ * A consistent snapshot of a live database, read through SQLite inside one
+ * read transaction, so writers carry on but none of their commits show up
+ * part way through. Pages come from the sqlite_dbpage virtual table, which
+ * sees pages still in the WAL, if SQLite was built with it.
+ */
+class SnapshotSource : public Source {
+
+	sqlite3 * db;
+	sqlite3_stmt * pages;  // NULL if sqlite_dbpage is not available
+	const char * page;     // Current page, and how much of it has been read
+	size_t page_len, page_pos;
+	uint64_t pos;
+	uint64_t length;
+	bool wal;
+
+	SnapshotSource(const SnapshotSource &);
+	SnapshotSource & operator= (const SnapshotSource &);
+
+	// Returns the text of the first column of sql, or "" on error
+	string query(const char * sql) {
+		sqlite3_stmt * stmt;
+		string result;
+		if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+			return result;
+		if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0) != NULL)
+			result = (const char *) sqlite3_column_text(stmt, 0);
+		sqlite3_finalize(stmt);
+		return result;
+	}
+
+public:
+	SnapshotSource() : db(NULL), pages(NULL), page(NULL), page_len(0), page_pos(0),
+		pos(0), length(0), wal(false) {}
+
+	~SnapshotSource() {
+		sqlite3_finalize(pages);
+		sqlite3_close(db); // Ends the read transaction
+	}
+
+	/**
+	 * Open path and start the read transaction. Returns false, having
+	 * said why, if that fails.
+	 */
+	bool open(const char * path) {
+		if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+			cerr << "Failed to open source database: " << sqlite3_errmsg(db) << endl;
+			return false;
+		}
+		sqlite3_busy_timeout(db, 10000);
+
+		// The transaction only takes its snapshot on the first read
+		if (sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK
+		 || query("PRAGMA page_count").empty()) {
+			cerr << "Failed to start a read transaction: " << sqlite3_errmsg(db) << endl;
+			return false;
+		}
+		length = strtoull(query("PRAGMA page_count").c_str(), NULL, 10)
+		       * strtoull(query("PRAGMA page_size").c_str(), NULL, 10);
+		wal = query("PRAGMA journal_mode") == "wal";
+
+		if (sqlite3_prepare_v2(db, "SELECT data FROM sqlite_dbpage('main') ORDER BY pgno",
+		                       -1, &pages, NULL) != SQLITE_OK)
+			pages = NULL;
+		return true;
+	}
+
+	// Without sqlite_dbpage, the caller has to get the pages another way
+	bool has_pages() const { return pages != NULL; }
+
+	// In WAL mode the file alone is not the snapshot
+	bool is_wal() const { return wal; }
+
+	/**
+	 * Copy the snapshot to a new database at path with the backup API.
+	 * Returns false, having said why, on error.
+	 */
+	bool backup(const char * path) {
+		sqlite3 * copy;
+		int rc = sqlite3_open(path, &copy);
+		if (rc == SQLITE_OK) {
+			sqlite3_backup * b = sqlite3_backup_init(copy, "main", db, "main");
+			if (b != NULL) {
+				sqlite3_backup_step(b, -1);
+				sqlite3_backup_finish(b);
+			}
+			rc = sqlite3_errcode(copy);
+			if (rc == SQLITE_OK)
+				rc = sqlite3_exec(copy, "PRAGMA journal_mode=DELETE", NULL, NULL, NULL);
+		}
+		if (rc != SQLITE_OK)
+			cerr << "Failed to copy the snapshot: " << sqlite3_errmsg(copy) << endl;
+		sqlite3_close(copy);
+		return rc == SQLITE_OK;
+	}
+
+	const char * read(char * buf, size_t len, size_t & n) {
+		for (n = 0; n < len; ) {
+			if (page_pos == page_len) {
+				int rc = sqlite3_step(pages);
+				if (rc == SQLITE_DONE)
+					break;
+				if (rc != SQLITE_ROW) {
+					cerr << "Error while reading source: " << sqlite3_errmsg(db) << endl;
+					return NULL;
+				}
+				page = (const char *) sqlite3_column_blob(pages, 0);
+				page_len = sqlite3_column_bytes(pages, 0);
+				page_pos = 0;
+			}
+
+			size_t chunk = min(len - n, page_len - page_pos);
+			memcpy(buf + n, page + page_pos, chunk);
+			page_pos += chunk;
+			n += chunk;
+		}
+
+		// A copy of a WAL database is read as a rollback journal one, or
+		// SQLite would look for a WAL beside the compressed file
+		for (uint64_t i = 18; i <= 19; i++) {
+			if (i >= pos && i < pos + n && buf[i - pos] == 2)
+				buf[i - pos] = 1;
+		}
+		pos += n;
+		return buf;
+	}
+
+	int64_t size() const { return length; }
+};
+
+/**
+ * Several databases read one after another, for an archive. Each starts on
+ * a block boundary, its last block padded out with zeros in a buffer that
+ * lives as long as the source, so blocks stay put as a MappedFile's do.
+ */
+class ArchiveSource : public Source {
+
+	size_t block_size;
+	vector<MappedFile *> files;
+	vector<archive_member> members;
+	vector< vector<char> > tails; // Padded last block of each, if short
+	size_t current;               // Database being read
+	uint64_t pos;                 // How far into it
+	uint64_t length;              // Of them all, padded
+
+	ArchiveSource(const ArchiveSource &);
+	ArchiveSource & operator= (const ArchiveSource &);
+
+public:
+	explicit ArchiveSource(size_t block_size)
+		: block_size(block_size), current(0), pos(0), length(0) {}
+
+	~ArchiveSource() {
+		for (size_t i = 0; i < files.size(); i++)
+			delete files[i];
+	}
+
+	/**
+	 * Add the database at path, named by its file name. Returns false,
+	 * having said why, if it can't be mapped or the name is taken.
+	 */
+	bool add(const char * path) {
+		const char * slash = strrchr(path, '/');
+		string name = slash ? slash + 1 : path;
+		for (size_t i = 0; i < members.size(); i++) {
+			if (members[i].name == name) {
+				cerr << "Two databases named " << name << " in one archive" << endl;
+				return false;
+			}
+		}
+
+		MappedFile * file = new MappedFile();
+		if (name.empty() || !file->open(path)) {
+			delete file;
+			cerr << "Failed to map source file: " << path << endl;
+			return false;
+		}
+		files.push_back(file);
+		members.push_back(archive_member(name, length / block_size, file->size()));
+
+		uint64_t tail = file->size() % block_size;
+		tails.push_back(vector<char>(tail ? block_size : 0, '\0'));
+		if (tail)
+			memcpy(&tails.back()[0], file->get_data() + file->size() - tail, tail);
+		length += (file->size() + block_size - 1) / block_size * block_size;
+		return true;
+	}
+
+	const vector<archive_member> & get_members() const { return members; }
+
+	// The mapped bytes of database i
+	const char * get_data(size_t i) const { return files[i]->get_data(); }
+
+	// len must be the block size
+	const char * read(char *, size_t len, size_t & n) {
+		assert(len == block_size);
+		while (current < files.size() && pos >= (uint64_t) files[current]->size()) {
+			current++;
+			pos = 0;
+		}
+		n = 0;
+		if (current == files.size())
+			return "";
+
+		uint64_t left = files[current]->size() - pos;
+		const char * p = left >= block_size ? files[current]->get_data() + pos : &tails[current][0];
+		pos += block_size;
+		n = block_size;
+		return p;
+	}
+
+	bool in_place() const { return true; }
+	int64_t size() const { return length; }
+};
+
+/**
+ * The output of a previous run over an older copy of the source, written
+ * with FLAG_BLOCK_HASHES. Blocks whose hash has not changed are copied
+ * from it compressed rather than compressed again.
+ */
+class BaseFile {
+
+	CompressedFile file;
+
+public:
+	/**
+	 * Map and check the file at path. Returns false, having said why, if it
+	 * can't be used.
+	 */
+	bool open(const char * path) {
+		if (!file.open(path))
+			return false;
+		if (!file.has_hashes()) {
+			cerr << "Base file has no block hashes: " << path << endl;
+			return false;
+		}
+		return true;
+	}
+
+	uint32_t get_block_size() const { return file.get_block_size(); }
+
+	/**
+	 * If block seq of the base file has the given hash, copy its compressed
+	 * bytes to out, which has room for max_out bytes, set out_len and codec,
+	 * and return true. A reference is copied as the block it refers to, as
+	 * the block numbers it names may not hold the same data any more.
+	 */
+	bool find(uint64_t seq, uint64_t hash, char * out, size_t max_out,
+	          size_t & out_len, enum codec & codec) const {
+		if (seq >= file.get_block_count() || file.get_hash(seq) != hash)
+			return false;
+		uint64_t stored = file.resolve(seq);
+		if (stored == file.get_block_count())
+			return false;
+		size_t len;
+		const char * block = file.get_block(stored, len, codec);
+		if (len > max_out || len > INDEX_LEN_MASK)
+			return false;
+		memcpy(out, block, len);
+		out_len = len;
+		return true;
+	}
+};
+
+/**
+ * What a block is used for, in order of how much its read latency
+ * matters. A block holding several pages takes the most important class.
+ */
+enum page_class {
+	PAGE_INTERIOR_INDEX = 0,
+	PAGE_INTERIOR_TABLE,
+	PAGE_LEAF_INDEX,
+	PAGE_LEAF_TABLE,
+	PAGE_OVERFLOW,  // Overflow, pointer map, and any other non b-tree page
+	PAGE_FREELIST,
+	PAGE_CLASSES
+};
+
+const char * page_class_names[PAGE_CLASSES] = {
+	"interior-index", "interior-table", "leaf-index", "leaf-table", "overflow", "freelist"
+};
+
+static uint32_t get_be32(const unsigned char *p) {
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
 }
 
-class SnappyCompressor {
+/**
+ * Works out the class of each block by reading SQLite page headers, and
+ * the freelist so that free pages (whose bytes look like whatever used to
+ * be there) are not mistaken for b-tree pages.
+ *
+ * The freelist is either walked up front with load(), or, when the input
+ * can't seek, followed as its trunk pages go past in classify(). In that
+ * case free pages listed by a trunk that comes after them in the file, or
+ * by a trunk split across blocks, are classed by their contents instead.
+ *
+ * Freelist leaf pages hold nothing SQLite will ever read, so classify()
+ * also says whether a block is made of nothing else and need not be
+ * stored. It only does so once load() has found as many free pages as
+ * the header says there are, so a damaged freelist can't lose live pages.
+ */
+class PageClassifier {
+
+	enum free_page { NOT_FREE = 0, FREE_TRUNK, FREE_LEAF };
+
+	size_t page_size;        // 0 if the input is not a SQLite database
+	uint32_t page_count;     // Pages in the database, as far as is known
+	vector<unsigned char> free_pages; // free_page, indexed by page number
+	uint32_t free_count;     // Pages marked free so far
+	uint32_t next_trunk;     // Freelist trunk not yet seen by classify()
+	enum page_class current; // Class of the page the last block ended in
+	bool current_unused;     // Whether that page is a freelist leaf
+	bool leaves_unused;      // The freelist checked out, and may be dropped
+
+	void mark_free(uint32_t page, enum free_page kind) {
+		if (page >= free_pages.size())
+			free_pages.resize(page + 1, NOT_FREE);
+		if (free_pages[page] == NOT_FREE)
+			free_count++;
+		if (free_pages[page] != FREE_TRUNK)
+			free_pages[page] = kind;
+	}
+
+	bool is_free(uint32_t page) const {
+		return page < free_pages.size() && free_pages[page] != NOT_FREE;
+	}
+
+	// Marks the trunk page p and its leaves free, returns the next trunk
+	uint32_t read_trunk(const unsigned char *p, uint32_t page) {
+		mark_free(page, FREE_TRUNK);
+		uint32_t leaves = get_be32(p + 4);
+		for (uint32_t i = 0; i < leaves && 8 + i * 4 + 4 <= page_size; i++) {
+			uint32_t leaf = get_be32(p + 8 + i * 4);
+			if (leaf <= page_count)
+				mark_free(leaf, FREE_LEAF);
+		}
+		return get_be32(p);
+	}
+
+public:
+	PageClassifier() : page_size(0), page_count(0), free_count(0), next_trunk(0),
+	                   current(PAGE_OVERFLOW), current_unused(false), leaves_unused(false) {}
+
+	size_t get_page_size() const { return page_size; }
+
+	/**
+	 * Take the page size and first freelist trunk from the 100 byte
+	 * database header. Returns false if it is not a SQLite database.
+	 */
+	bool load_header(const unsigned char *head, size_t len) {
+		if (len < 100 || memcmp(head, "SQLite format 3", 16) != 0)
+			return false;
+
+		page_size = (head[16] << 8) | head[17];
+		if (page_size == 1)
+			page_size = 65536;
+		page_count = get_be32(head + 28); // May be stale in old databases
+		next_trunk = get_be32(head + 32);
+		return true;
+	}
+
+	/**
+	 * Read the database header and walk the freelist trunk pages of the
+	 * len byte database at data.
+	 */
+	void load(const char * data, uint64_t len) {
+		const unsigned char * db = reinterpret_cast<const unsigned char *>(data);
+		if (!load_header(db, len))
+			return;
+
+		page_count = (uint32_t) (len / page_size);
+		free_pages.assign(page_count + 1, NOT_FREE);
+		free_count = 0;
+
+		// Trunk pages hold the next trunk, a leaf count, then the leaves
+		uint32_t seen = 0;
+		while (next_trunk != 0 && next_trunk <= page_count && seen++ < page_count)
+			next_trunk = read_trunk(db + (uint64_t) (next_trunk - 1) * page_size, next_trunk);
+		leaves_unused = next_trunk == 0 && free_count == get_be32(db + 36) && !is_free(1);
+		next_trunk = 0;
+	}
+
+	// Store freelist leaf pages like any other, for byte identical restores
+	void keep_free_pages() { leaves_unused = false; }
+
+	/**
+	 * Return the class of the block holding data starting at offset, and
+	 * set unused if it holds only freelist leaf pages. Blocks must be
+	 * passed in file order.
+	 */
+	enum page_class classify(const char * data, size_t len, long long offset, bool & unused) {
+		unused = false;
+		if (page_size == 0)
+			return PAGE_OVERFLOW;
+
+		enum page_class best = PAGE_CLASSES;
+		unused = leaves_unused;
+
+		// A block that starts part way into a page belongs to that page
+		size_t first = (page_size - offset % page_size) % page_size;
+		if (first != 0) {
+			best = current;
+			unused = unused && current_unused;
+		}
+
+		for (size_t i = first; i < len; i += page_size) {
+			uint32_t page = (uint32_t) ((offset + i) / page_size) + 1;
+			if (i + (page == 1 ? 100 : 0) >= len)
+				break;
+			unsigned char type = data[i + (page == 1 ? 100 : 0)];
+
+			current_unused = leaves_unused && page < free_pages.size() && free_pages[page] == FREE_LEAF;
+			unused = unused && current_unused;
+
+			if (page == next_trunk) {
+				if (i + page_size <= len)
+					next_trunk = read_trunk(reinterpret_cast<const unsigned char *>(data + i), page);
+				else
+					next_trunk = 0;
+				current = PAGE_FREELIST;
+			} else if (is_free(page)) {
+				current = PAGE_FREELIST;
+			} else if (type == 0x02) {
+				current = PAGE_INTERIOR_INDEX;
+			} else if (type == 0x05) {
+				current = PAGE_INTERIOR_TABLE;
+			} else if (type == 0x0A) {
+				current = PAGE_LEAF_INDEX;
+			} else if (type == 0x0D) {
+				current = PAGE_LEAF_TABLE;
+			} else {
+				current = PAGE_OVERFLOW;
+			}
+
+			if (current < best)
+				best = current;
+		}
+
+		return best == PAGE_CLASSES ? current : best;
+	}
+};
+
+/**
+ * Classifies the blocks of an archive with a PageClassifier per database,
+ * each given offsets from the start of its own database.
+ */
+class ArchiveClassifier {
+
+	vector<PageClassifier> classes;
+	vector<uint64_t> starts; // Offset of each database in the archive
 
 public:
-	SnappyCompressor() {}
+	// Add the len byte database at data, which starts at start
+	void add(const char * data, uint64_t len, uint64_t start, bool keep_free) {
+		classes.push_back(PageClassifier());
+		classes.back().load(data, len);
+		if (keep_free)
+			classes.back().keep_free_pages();
+		starts.push_back(start);
+	}
+
+	size_t get_page_size() const { return classes.empty() ? 0 : classes[0].get_page_size(); }
 
-	void compress(const std::string & in, std::string & out) {
-		Compress(in.data(), in.size(), &out);
+	// Every database was loaded by add()
+	bool load_header(const unsigned char *, size_t) { return false; }
 
-		#ifdef PARANOID
-		assert( IsValidCompressedBuffer(string_as_array(&out), out.size()) );
-		#endif
+	enum page_class classify(const char * data, size_t len, long long offset, bool & unused) {
+		size_t i = upper_bound(starts.begin(), starts.end(), (uint64_t) offset) - starts.begin() - 1;
+		return classes[i].classify(data, len, offset - starts[i], unused);
 	}
 };
 
+// Fewer bytes than this say too little about their entropy to skip on
+#define MIN_ENTROPY_LEN 256
+
 /**
- * TODO Test LZO1F
+ * One compressor per codec name, shared by the page classes that use it.
+ * Compressors keep scratch state, so each thread needs its own set.
  */
-class LZOCompressor {
+class CompressorSet {
 
-	char * wrkmem;
+	map<string, Compressor *> by_name;
+	Compressor * by_class[PAGE_CLASSES];
+	RawCompressor raw;
+	double max_entropy;
 
 public:
-	LZOCompressor() {
-		if (lzo_init() != LZO_E_OK) {
-			cerr << "Failed to init LZO" << endl;
-			throw new runtime_error("Failed to init LZO");
+	uint64_t skipped; // Blocks stored raw on their entropy alone
+
+	// Blocks of more than max_entropy bits per byte are stored raw without
+	// trying their codec. 8 tries every block.
+	explicit CompressorSet(double max_entropy = 8) : max_entropy(max_entropy), skipped(0) {}
+
+	~CompressorSet() {
+		map<string, Compressor *>::iterator it;
+		for (it = by_name.begin(); it != by_name.end(); ++it)
+			delete it->second;
+	}
+
+	/**
+	 * Create the compressors for policy, one codec name per page class.
+	 * Returns false, with the unknown name in bad, if a codec is unknown.
+	 */
+	bool init(const string policy[PAGE_CLASSES], string & bad) {
+		for (int c = 0; c < PAGE_CLASSES; c++) {
+			Compressor *& compressor = by_name[policy[c]];
+			if (compressor == NULL)
+				compressor = new_compressor(policy[c]);
+			if (compressor == NULL) {
+				bad = policy[c];
+				return false;
+			}
+			by_class[c] = compressor;
 		}
+		return true;
+	}
 
-		this->wrkmem = new char[LZO1X_1_MEM_COMPRESS];
+	// Room compress() needs in out for len bytes, whatever the class
+	size_t max_compressed_length(size_t len) const {
+		size_t max = raw.max_compressed_length(len);
+		map<string, Compressor *>::const_iterator it;
+		for (it = by_name.begin(); it != by_name.end(); ++it)
+			max = std::max(max, it->second->max_compressed_length(len));
+		return max;
 	}
 
-	~LZOCompressor() {
-		delete[] this->wrkmem;
+	/**
+	 * Compress len bytes at in, a block of class c, into out. Returns the
+	 * compressed length and sets codec to the codec used. Blocks are never
+	 * stored larger than they started, and blocks that look random aren't
+	 * given the chance.
+	 */
+	size_t compress(enum page_class c, const char * in, size_t len, char * out, enum codec & codec) {
+		Compressor * compressor = by_class[c];
+		if (compressor->codec() != CODEC_RAW && max_entropy < 8
+		    && len >= MIN_ENTROPY_LEN && byte_entropy(in, len) > max_entropy) {
+			compressor = &raw;
+			skipped++;
+		}
+		size_t out_len = compressor->compress(in, len, out);
+
+		if (out_len >= len && compressor->codec() != CODEC_RAW) {
+			compressor = &raw;
+			out_len = compressor->compress(in, len, out);
+		}
+		assert(out_len <= INDEX_LEN_MASK);
+		codec = compressor->codec();
+		return out_len;
 	}
+};
+
+/**
+ * Fixed capacity multi-producer multi-consumer queue, after Dmitry Vyukov's
+ * bounded MPMC queue. Neither end ever takes a lock: each cell carries a
+ * sequence number saying whether it is ready to be pushed to or popped
+ * from, and the ends claim cells with a compare and swap. push() and pop()
+ * return false rather than block when the queue is full or empty.
+ */
+template <typename T>
+class BoundedQueue {
 
-	void compress(const std::string & in, std::string & out) {
-		size_t in_len = in.size();
-		size_t out_len = in_len + in_len / 16 + 64 + 3;
-		out.reserve(out_len);
+	struct cell {
+		atomic<size_t> seq;
+		T data;
+	};
 
-		int r = lzo1x_1_compress(
-			(unsigned char *) string_as_array(&in), in_len,
-			(unsigned char *) string_as_array(&out), &out_len, wrkmem);
-		if (r != LZO_E_OK) {
-			printf("internal error - compression failed: %d\n", r);
+	cell * cells;
+	size_t mask;
+	char pad0[64];
+	atomic<size_t> head; // Next cell to push to
+	char pad1[64];
+	atomic<size_t> tail; // Next cell to pop from
+	char pad2[64];
+
+	BoundedQueue(const BoundedQueue &);
+	BoundedQueue & operator= (const BoundedQueue &);
+
+public:
+	// capacity is rounded up to a power of two
+	explicit BoundedQueue(size_t capacity) : head(0), tail(0) {
+		size_t size = 2;
+		while (size < capacity)
+			size *= 2;
+		cells = new cell[size];
+		mask = size - 1;
+		for (size_t i = 0; i < size; i++)
+			cells[i].seq.store(i, memory_order_relaxed);
+	}
+
+	~BoundedQueue() {
+		delete[] cells;
+	}
+
+	bool push(const T & data) {
+		size_t pos = head.load(memory_order_relaxed);
+		for (;;) {
+			cell * c = &cells[pos & mask];
+			intptr_t diff = (intptr_t) c->seq.load(memory_order_acquire) - (intptr_t) pos;
+			if (diff == 0) {
+				if (head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+					c->data = data;
+					c->seq.store(pos + 1, memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false; // Full
+			} else {
+				pos = head.load(memory_order_relaxed);
+			}
 		}
+	}
 
-		out.resize(out_len);
+	bool pop(T & data) {
+		size_t pos = tail.load(memory_order_relaxed);
+		for (;;) {
+			cell * c = &cells[pos & mask];
+			intptr_t diff = (intptr_t) c->seq.load(memory_order_acquire) - (intptr_t) (pos + 1);
+			if (diff == 0) {
+				if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+					data = c->data;
+					c->seq.store(pos + mask + 1, memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false; // Empty
+			} else {
+				pos = tail.load(memory_order_relaxed);
+			}
+		}
 	}
 };
 
-int main(int argc, const char *argv[]) {
-	const size_t block_size = 4096;
+/**
+ * How long a pipeline stage spent with nothing to do. A stage that stalls
+ * a lot is waiting on a slower neighbour; the one that stalls least is the
+ * bottleneck.
+ */
+struct stage_stats {
+	atomic<uint64_t> stalls;   // Times it found its input empty
+	atomic<uint64_t> stall_ns; // Time spent waiting, summed over threads
 
-	if (argc != 3) {
-		cerr << "Usage: " << argv[0] << " {source} {dest}" << endl;
-		return -1;
+	stage_stats() : stalls(0), stall_ns(0) {}
+
+	// Retries op, backing off, until it returns true or stop is set.
+	// Returns false if it gave up because of stop.
+	template <typename Op>
+	bool wait(Op op, const atomic<bool> & stop) {
+		if (op())
+			return true;
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		bool ok = false;
+		stalls++;
+		for (unsigned spins = 0; !stop.load(); spins++) {
+			if ((ok = op()))
+				break;
+			if (spins < 64)
+				this_thread::yield();
+			else
+				this_thread::sleep_for(chrono::microseconds(50));
+		}
+		stall_ns += chrono::duration_cast<chrono::nanoseconds>(
+			chrono::steady_clock::now() - start).count();
+		return ok;
 	}
+};
 
-	const char * src = argv[1];
-	const char * dst = argv[2];
+/**
+ * True if the len bytes at p are all zero. Words are ORed together 64
+ * bytes at a time, which compilers turn into vector loads, and most blocks
+ * that aren't zero are given up on in the first 64 bytes.
+ */
+static bool is_zero(const char * p, size_t len) {
+	size_t i = 0;
+	for (; i + 64 <= len; i += 64) {
+		uint64_t any = 0;
+		for (size_t j = 0; j < 64; j += 8) {
+			uint64_t word;
+			memcpy(&word, p + i + j, sizeof(word));
+			any |= word;
+		}
+		if (any != 0)
+			return false;
+	}
+	for (; i < len; i++) {
+		if (p[i] != 0)
+			return false;
+	}
+	return true;
+}
 
-	ifstream in_file (src, ios::binary | ios::in);
-	if (!in_file) {
-		cerr << "Failed to open source file: " << src << endl;
-		return -1;
+/**
+ * A block on its way through the Pipeline. There are a fixed number of
+ * these, recycled once written, and their buffers are carved from one slab
+ * allocated up front, so the pipeline does no heap allocation per block.
+ */
+struct block_job {
+	uint64_t seq;              // Position of the block in the file
+	enum page_class page_class;
+	bool unused;               // Only freelist leaf pages, see PageClassifier
+	const char * in;           // Uncompressed, in the mapping or in_buf
+	size_t in_len;
+	char * in_buf;             // Read buffer when the source is a stream
+	char * out;                // Compressed
+	size_t out_len;
+	enum codec codec;          // Used for out
+	uint64_t hash;             // block_hash() of in
+	bool reused;               // out was copied from the base file
+};
+
+/**
+ * Reads, compresses and writes blocks in three overlapping stages: one
+ * reader thread, a pool of compressor threads, and the writer on the
+ * calling thread. Blocks finish compressing in any order; the writer puts
+ * them back in sequence so the blocks and their index entries go out in
+ * file order whatever the thread count.
+ *
+ *   reader --work--> compressors --done--> writer
+ *      ^------------------free-----------------'
+ */
+class Pipeline {
+
+	const string * policy;
+	unsigned threads;
+	size_t block_size;
+	size_t max_out;
+	const BaseFile * base;    // NULL if every block is to be compressed
+	double max_entropy;       // For CompressorSet
+	uint64_t zero_hash;       // block_hash() of block_size zeros
+	bool dedup;               // Store repeated blocks once
+	size_t slots;             // Blocks in flight
+
+	vector<block_job> jobs;
+	vector<char> slab;        // Buffers for all the jobs
+	BoundedQueue<block_job *> free_jobs, work, done;
+
+	atomic<bool> read_done;   // submitted is final
+	atomic<bool> failed;      // Some stage hit an error, all should stop
+	atomic<uint64_t> submitted;
+	atomic<uint64_t> read_bytes;
+	atomic<uint64_t> skipped; // Sum of each thread's CompressorSet::skipped
+
+	// The first block written with each hash, and where its data is
+	typedef pair<uint64_t, const char *> first_block;
+	unordered_map<uint64_t, first_block> first_seen;
+	mutex first_lock;
+
+	template <typename Classifier>
+	void read(Source * source, Classifier & classifier) {
+		uint64_t seq = 0, in_total = 0;
+
+		for (;;) {
+			block_job * job;
+			if (!reader.wait([&] { return free_jobs.pop(job); }, failed))
+				break;
+
+			job->in = source->read(job->in_buf, block_size, job->in_len);
+			if (job->in == NULL) {
+				failed = true;
+				break;
+			}
+			if (job->in_len == 0) {
+				free_jobs.push(job);
+				break;
+			}
+
+			// Sources that were not mapped have not been looked at yet
+			if (in_total == 0 && classifier.get_page_size() == 0)
+				classifier.load_header(reinterpret_cast<const unsigned char *>(job->in), job->in_len);
+
+			job->seq = seq++;
+			job->page_class = classifier.classify(job->in, job->in_len, in_total, job->unused);
+			in_total += job->in_len;
+			read_bytes = in_total;
+
+			// Can't be full, there are only as many jobs as slots
+			work.push(job);
+			submitted = seq;
+		}
+		read_done = true;
+	}
+
+	/**
+	 * If the first block written with job's hash has the same contents,
+	 * make job a CODEC_REF to it and return true. Blocks are compared byte
+	 * for byte, so this needs a source whose blocks stay where they are read.
+	 *
+	 * Only the writer adds to first_seen, in file order, so which block is
+	 * first does not depend on which thread finishes first. Compressors
+	 * call this to skip work on copies of blocks already written, and the
+	 * writer again for copies that were still in flight.
+	 */
+	bool refer(block_job * job) {
+		first_block first;
+		{
+			lock_guard<mutex> lock(first_lock);
+			unordered_map<uint64_t, first_block>::iterator it = first_seen.find(job->hash);
+			if (it == first_seen.end())
+				return false;
+			first = it->second;
+		}
+		if (first.first >= job->seq || memcmp(first.second, job->in, job->in_len) != 0)
+			return false;
+
+		put_le64(job->out, first.first);
+		job->out_len = REF_SIZE;
+		job->codec = CODEC_REF;
+		job->reused = false;
+		return true;
+	}
+
+	// In the writer, before job is written: make it a reference to an
+	// earlier copy, or note it as the first with its hash
+	void dedup_written(block_job * job) {
+		if (!dedup || job->in_len != block_size || job->codec == CODEC_HOLE || job->codec == CODEC_REF)
+			return;
+		if (refer(job))
+			return;
+		lock_guard<mutex> lock(first_lock);
+		first_seen.insert(make_pair(job->hash, first_block(job->seq, job->in)));
+	}
+
+	void compress() {
+		CompressorSet compressors(max_entropy);
+		string bad;
+		compressors.init(policy, bad); // Already checked by the caller
+
+		for (;;) {
+			// Once the reader is done nothing more is pushed, so an empty
+			// queue after that means all the work has been taken
+			block_job * job = NULL;
+			bool ok = compressor.wait([&] {
+				bool finished = read_done.load();
+				return work.pop(job) || finished;
+			}, failed);
+			if (!ok || job == NULL)
+				break;
+
+			// Whole blocks that will read back as zeros are not stored at all
+			job->reused = false;
+			if (job->in_len == block_size && (job->unused || is_zero(job->in, job->in_len))) {
+				job->hash = zero_hash;
+				job->out_len = 0;
+				job->codec = CODEC_HOLE;
+				done.push(job);
+				continue;
+			}
+
+			job->hash = block_hash(job->in, job->in_len);
+			if (dedup && job->in_len == block_size && refer(job)) {
+				done.push(job);
+				continue;
+			}
+			job->reused = base != NULL
+				&& base->find(job->seq, job->hash, job->out, max_out, job->out_len, job->codec);
+			if (!job->reused)
+				job->out_len = compressors.compress(job->page_class, job->in, job->in_len, job->out, job->codec);
+			done.push(job);
+		}
+		skipped += compressors.skipped;
+	}
+
+public:
+	stage_stats reader, compressor, writer;
+
+	// max_out is the most a block_size block can compress to, and in_buffers
+	// is true if the source needs buffers to read into. Unchanged blocks are
+	// taken from base, if not NULL, and blocks of more than max_entropy bits
+	// per byte are stored raw. Repeated blocks are stored once if dedup is
+	// set and the source is read in place.
+	Pipeline(const string policy[PAGE_CLASSES], unsigned threads, size_t block_size,
+	         size_t max_out, bool in_buffers, const BaseFile * base, double max_entropy, bool dedup)
+		: policy(policy), threads(threads), block_size(block_size),
+		  max_out(max_out), base(base), max_entropy(max_entropy), dedup(dedup && !in_buffers),
+		  slots(threads * 4), jobs(slots), free_jobs(slots), work(slots), done(slots),
+		  read_done(false), failed(false), submitted(0), read_bytes(0), skipped(0) {
+		size_t in_size = in_buffers ? block_size : 0;
+		slab.resize(slots * (in_size + max_out));
+		zero_hash = block_hash(string(block_size, '\0').data(), block_size);
+		for (size_t i = 0; i < slots; i++) {
+			jobs[i].in_buf = in_buffers ? &slab[i * in_size] : NULL;
+			jobs[i].out = &slab[slots * in_size + i * max_out];
+			free_jobs.push(&jobs[i]);
+		}
+	}
+
+	/**
+	 * Compress all of source, calling write(job) for each block in file
+	 * order. write returns false to stop early. Returns false on any error.
+	 */
+	template <typename Classifier, typename Write>
+	bool run(Source * source, Classifier & classifier, Write write) {
+		thread read_thread(&Pipeline::read<Classifier>, this, source, ref(classifier));
+		vector<thread> compress_threads;
+		for (unsigned i = 0; i < threads; i++)
+			compress_threads.push_back(thread(&Pipeline::compress, this));
+
+		// Finished blocks wait here until those before them are written
+		vector<block_job *> pending(slots, (block_job *) NULL);
+		uint64_t written = 0;
+
+		for (;;) {
+			block_job * job = pending[written % slots];
+			if (job == NULL) {
+				bool ok = writer.wait([&] {
+					bool finished = read_done.load() && written == submitted.load();
+					return done.pop(job) || finished;
+				}, failed);
+				if (!ok || job == NULL)
+					break;
+				pending[job->seq % slots] = job;
+				continue;
+			}
+
+			pending[written % slots] = NULL;
+			written++;
+			dedup_written(job);
+			if (!write(job)) {
+				failed = true;
+				break;
+			}
+			free_jobs.push(job);
+		}
+
+		read_thread.join();
+		for (size_t i = 0; i < compress_threads.size(); i++)
+			compress_threads[i].join();
+		return !failed;
+	}
+
+	uint64_t get_read_bytes() const { return read_bytes; }
+
+	// Only final once run() has returned
+	uint64_t get_skipped() const { return skipped; }
+};
+
+/**
+ * Picks the block size, and a codec for each page class, for --tune. It
+ * compresses a sample of the blocks with every codec at each candidate
+ * block size, timing how long each takes to decompress, and then either
+ *
+ *   - maximises the ratio while the 99th percentile time to decode one
+ *     block stays under a latency budget, or
+ *   - minimises that latency while the ratio stays over a goal.
+ *
+ * A block is the unit a cache miss has to decode, so its decode time is
+ * what a query waits for. Classes are chosen separately, as the default
+ * policy is, and the block size with the best result for the goal wins.
+ */
+class Tuner {
+
+	const char * data;
+	uint64_t length;
+	const PageClassifier & classifier;
+	double sample;      // Fraction of blocks to try
+	double latency_us;  // Budget, or 0 to tune for ratio
+	double ratio;       // Goal, if latency_us is 0
+	size_t overhead;    // Index and hash bytes per block
+
+	struct trial {
+		uint64_t in, out;   // Bytes in the sampled blocks, and compressed
+		vector<double> us;  // Time to decode each block
+
+		trial() : in(0), out(0) {}
+
+		double get_ratio() const { return out ? (double) in / out : 1; }
+
+		double p99() const {
+			if (us.empty())
+				return 0;
+			vector<double> sorted(us);
+			sort(sorted.begin(), sorted.end());
+			return sorted[min(sorted.size() - 1, sorted.size() * 99 / 100)];
+		}
+	};
+
+	// The result of one block size
+	struct choice {
+		size_t block_size;
+		string policy[PAGE_CLASSES];
+		double ratio;       // Over the sample, with policy
+		double p99_us;      // Worst of the classes
+	};
+
+	// Best of the codecs in trials for one class, for the goal
+	size_t pick(const vector<trial> & trials) const {
+		size_t best = 0;
+		bool best_fits = false;
+		for (size_t i = 0; i < trials.size(); i++) {
+			double r = trials[i].get_ratio(), us = trials[i].p99();
+			bool fits = latency_us > 0 ? us <= latency_us : r >= ratio;
+			bool better;
+			if (fits != best_fits)
+				better = fits;
+			else if (latency_us > 0)
+				better = fits ? r > trials[best].get_ratio() : us < trials[best].p99();
+			else
+				better = fits ? us < trials[best].p99() : r > trials[best].get_ratio();
+			if (i == 0 || better) {
+				best = i;
+				best_fits = fits;
+			}
+		}
+		return best;
+	}
+
+	/**
+	 * Sample blocks of block_size, starting from policy for classes that
+	 * are not sampled. Returns false if a block fails to round trip.
+	 */
+	bool try_block_size(size_t block_size, choice & result) {
+		vector<string> names;
+		vector<Compressor *> compressors;
+		for (int i = 0; compressor_names[i] != NULL; i++) {
+			names.push_back(compressor_names[i]);
+			compressors.push_back(new_compressor(compressor_names[i]));
+		}
+
+		vector< vector<trial> > trials(PAGE_CLASSES, vector<trial>(names.size()));
+		size_t max_out = 0;
+		for (size_t i = 0; i < compressors.size(); i++)
+			max_out = max(max_out, compressors[i]->max_compressed_length(block_size));
+		vector<char> out(max_out), raw(block_size);
+
+		// Pick blocks at random, as a fixed stride can keep landing on the
+		// same part of a page, but take at least a few hundred
+		uint64_t blocks = (length + block_size - 1) / block_size;
+		double p = max(sample, 256.0 / max<uint64_t>(blocks, 1));
+
+		PageClassifier classes(classifier);
+		bool ok = true;
+		for (uint64_t b = 0; b < blocks && ok; b++) {
+			char key[8];
+			put_le64(key, b);
+			if (block_hash(key, sizeof(key)) % 1000000 >= p * 1000000)
+				continue;
+
+			const char * in = data + b * block_size;
+			size_t len = (size_t) min<uint64_t>(block_size, length - b * block_size);
+			bool unused;
+			enum page_class c = classes.classify(in, len, b * block_size, unused);
+
+			// Holes cost their index entry whatever the codec
+			if (len == block_size && (unused || is_zero(in, len))) {
+				for (size_t i = 0; i < compressors.size(); i++) {
+					trials[c][i].in += len;
+					trials[c][i].out += overhead;
+				}
+				continue;
+			}
+
+			for (size_t i = 0; i < compressors.size() && ok; i++) {
+				size_t n = compressors[i]->compress(in, len, &out[0]);
+				chrono::steady_clock::time_point start = chrono::steady_clock::now();
+				ok = decompress(compressors[i]->codec(), &out[0], n, &raw[0], len)
+				  && memcmp(&raw[0], in, len) == 0;
+				trial & t = trials[c][i];
+				t.us.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+				t.in += len;
+				t.out += n + overhead;
+			}
+		}
+		for (size_t i = 0; i < compressors.size(); i++)
+			delete compressors[i];
+		if (!ok) {
+			cerr << "Block failed to round trip while tuning" << endl;
+			return false;
+		}
+
+		uint64_t in = 0, out_total = 0;
+		result.block_size = block_size;
+		result.p99_us = 0;
+		for (int c = 0; c < PAGE_CLASSES; c++) {
+			if (trials[c][0].in == 0)
+				continue;
+			size_t i = pick(trials[c]);
+			result.policy[c] = names[i];
+			in += trials[c][i].in;
+			out_total += trials[c][i].out;
+			result.p99_us = max(result.p99_us, trials[c][i].p99());
+		}
+		result.ratio = out_total ? (double) in / out_total : 1;
+		return true;
 	}
-//	in_file.exceptions(ios::badbit | ios::failbit);
 
+public:
+	Tuner(const char * data, uint64_t length, const PageClassifier & classifier,
+	      double sample, double latency_us, double ratio, size_t overhead)
+		: data(data), length(length), classifier(classifier), sample(sample),
+		  latency_us(latency_us), ratio(ratio), overhead(overhead) {}
+
+	/**
+	 * Set block_size and policy to the best found, reporting each block
+	 * size tried. Classes with no blocks in the sample keep their codec.
+	 * Returns false on error.
+	 */
+	bool tune(size_t & block_size, string policy[PAGE_CLASSES], ostream & report) {
+		static const size_t sizes[] = { 1024, 4096, 16384, 65536 };
+		choice best;
+		bool best_fits = false;
+
+		for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			choice c;
+			for (int i = 0; i < PAGE_CLASSES; i++)
+				c.policy[i] = policy[i];
+			if (!try_block_size(sizes[s], c))
+				return false;
+
+			bool fits = latency_us > 0 ? c.p99_us <= latency_us : c.ratio >= ratio;
+			report << "        Tune: " << c.block_size << " byte blocks, x" << c.ratio
+			       << ", p99 decode " << c.p99_us << " us" << (fits ? "" : " (misses goal)") << endl;
+
+			bool better;
+			if (s == 0 || fits != best_fits)
+				better = s == 0 || fits;
+			else if (latency_us > 0)
+				better = fits ? c.ratio > best.ratio : c.p99_us < best.p99_us;
+			else
+				better = fits ? c.p99_us < best.p99_us : c.ratio > best.ratio;
+			if (better) {
+				best = c;
+				best_fits = fits;
+			}
+		}
+
+		block_size = best.block_size;
+		report << "        Tune: chose " << block_size << " byte blocks";
+		for (int i = 0; i < PAGE_CLASSES; i++) {
+			policy[i] = best.policy[i];
+			report << ", " << page_class_names[i] << "=" << policy[i];
+		}
+		report << endl;
+		return true;
+	}
+};
+
+void usage(const char * argv0) {
+	cerr << "Usage: " << argv0 << " [--block-size=N] [--compact-index] [--footer-index] [--threads=T] [--progress] [--snapshot] [--base=OLD] [--no-hashes] [--max-entropy=BITS] [--keep-free] [--no-dedup] [--tune [--tune-sample=F] [--tune-latency=US | --tune-ratio=R]] [--CLASS=CODEC ...] {source} {dest}" << endl
+	     << "       " << argv0 << " [options] --archive=DEST {source} ..." << endl
+	     << "  N is the uncompressed bytes per block, default 4096" << endl
+	     << "  T is the number of compression threads, default one per core" << endl
+	     << "  --progress reports how far through the source it is on stderr" << endl
+	     << "  --snapshot reads a live source database through SQLite, in one read" << endl
+	     << "        transaction, so concurrent writers can't tear the copy" << endl
+	     << "  --base copies the blocks that have not changed since OLD, an earlier" << endl
+	     << "        output for the same database, instead of compressing them" << endl
+	     << "  --no-hashes leaves out the block hashes --base needs" << endl
+	     << "  --max-entropy stores blocks of more than BITS per byte raw without" << endl
+	     << "        trying to compress them, as for JPEG or zlib blobs. Default" << endl
+	     << "        7.9, and 8 tries every block" << endl
+	     << "  --keep-free stores freelist leaf pages, which are otherwise left out" << endl
+	     << "        and restored as zeros, so that restores are byte identical" << endl
+	     << "  --no-dedup stores every block, where blocks that repeat an earlier" << endl
+	     << "        one are otherwise stored once. Only mapped sources are deduped" << endl
+	     << "  --tune tries a fraction F (default 0.01) of the blocks with every" << endl
+	     << "        codec and block size, then compresses with the best ratio" << endl
+	     << "        whose p99 decode time per block is under US microseconds" << endl
+	     << "        (default 20), or with --tune-ratio the lowest decode time" << endl
+	     << "        with a ratio of at least R. Replaces --block-size and CLASS" << endl
+	     << "  --archive writes every source into the one file DEST, where blocks" << endl
+	     << "        they share are stored once. The VFS opens each by the path" << endl
+	     << "        DEST/NAME, for a source named NAME. Takes neither --tune," << endl
+	     << "        --base nor --snapshot" << endl
+	     << "  --compact-index stores block sizes instead of an mmapable offset table" << endl
+	     << "  --footer-index writes in one pass, with the index at the end. Implied" << endl
+	     << "        when source or dest is - for stdin or stdout" << endl
+	     << "  CLASS is one of interior-index, interior-table, leaf-index," << endl
+	     << "        leaf-table, overflow or freelist" << endl
+	     << "  CODEC is one of snappy, lzo, lzo999 or raw" << endl;
+}
+
+int main(int argc, const char *argv[]) {
+	size_t block_size = 4096;
+	uint32_t flags = FLAG_OFFSET_INDEX | FLAG_BLOCK_HASHES;
+	unsigned threads = thread::hardware_concurrency();
+	bool progress = false;
+	bool snapshot = false;
+	const char * base_path = NULL;
+	bool tune = false;
+	double tune_sample = 0.01, tune_latency = 20, tune_ratio = 0;
+	double max_entropy = 7.9;
+	bool keep_free = false;
+	bool dedup = true;
+	const char * archive_path = NULL;
+
+	// Interior pages are read on every lookup, so favour decode speed
+	// there, and ratio for the bulk of the file
+	string policy[PAGE_CLASSES] = {
+		"snappy", "snappy", "lzo999", "lzo999", "lzo999", "lzo"
+	};
+
+	int arg = 1;
+	for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+		const char * eq = strchr(argv[arg], '=');
+		if (eq && string(argv[arg] + 2, eq) == "block-size") {
+			block_size = strtoul(eq + 1, NULL, 10);
+			if (block_size == 0 || block_size > MAX_BLOCK_SIZE) {
+				cerr << "Block size must be between 1 and " << MAX_BLOCK_SIZE << endl;
+				return -1;
+			}
+			continue;
+		}
+		if (eq && string(argv[arg] + 2, eq) == "threads") {
+			threads = strtoul(eq + 1, NULL, 10);
+			continue;
+		}
+		if (eq && string(argv[arg] + 2, eq) == "base") {
+			base_path = eq + 1;
+			continue;
+		}
+		if (eq && string(argv[arg] + 2, eq) == "archive") {
+			archive_path = eq + 1;
+			continue;
+		}
+		if (strcmp(argv[arg], "--tune") == 0) {
+			tune = true;
+			continue;
+		}
+		if (eq && string(argv[arg] + 2, eq) == "tune-sample") {
+			tune_sample = atof(eq + 1);
+			continue;
+		}
+		if (eq && string(argv[arg] + 2, eq) == "tune-latency") {
+			tune_latency = atof(eq + 1);
+			tune_ratio = 0;
+			continue;
+		}
+		if (eq && string(argv[arg] + 2, eq) == "tune-ratio") {
+			tune_ratio = atof(eq + 1);
+			tune_latency = 0;
+			continue;
+		}
+		if (eq && string(argv[arg] + 2, eq) == "max-entropy") {
+			max_entropy = atof(eq + 1);
+			if (max_entropy <= 0 || max_entropy > 8) {
+				cerr << "Max entropy must be more than 0 and at most 8 bits" << endl;
+				return -1;
+			}
+			continue;
+		}
+		if (strcmp(argv[arg], "--keep-free") == 0) {
+			keep_free = true;
+			continue;
+		}
+		if (strcmp(argv[arg], "--no-dedup") == 0) {
+			dedup = false;
+			continue;
+		}
+		if (strcmp(argv[arg], "--no-hashes") == 0) {
+			flags &= ~FLAG_BLOCK_HASHES;
+			continue;
+		}
+		if (strcmp(argv[arg], "--snapshot") == 0) {
+			snapshot = true;
+			continue;
+		}
+		if (strcmp(argv[arg], "--progress") == 0) {
+			progress = true;
+			continue;
+		}
+		if (strcmp(argv[arg], "--compact-index") == 0) {
+			flags &= ~FLAG_OFFSET_INDEX;
+			continue;
+		}
+		if (strcmp(argv[arg], "--footer-index") == 0) {
+			flags |= FLAG_FOOTER_INDEX;
+			continue;
+		}
 
-	ofstream out_file(dst, ios::binary | ios::out);
-	if (!out_file) {
-		cerr << "Failed to open output file: " << dst << endl;
+		int c = 0;
+		for (; eq && c < PAGE_CLASSES; c++) {
+			if (string(argv[arg] + 2, eq) == page_class_names[c])
+				break;
+		}
+		if (eq == NULL || c == PAGE_CLASSES) {
+			usage(argv[0]);
+			return -1;
+		}
+		policy[c] = eq + 1;
+	}
+
+	if (archive_path ? argc - arg < 1 : argc - arg != 2) {
+		usage(argv[0]);
+		return -1;
+	}
+	if (archive_path && (tune || base_path || snapshot)) {
+		cerr << "--archive takes neither --tune, --base nor --snapshot" << endl;
 		return -1;
 	}
-//	out_file.exceptions(ios::badbit | ios::failbit);
 
-	LZOCompressor * compressor = new LZOCompressor();
-	//SnappyCompressor * compressor = new SnappyCompressor();
+	const char * src = argv[arg];
+	const char * dst = archive_path ? archive_path : argv[arg + 1];
 
-	int index_len = file_len(in_file) / block_size + 1;
+	if (tune && (tune_sample <= 0 || tune_sample > 1 || (tune_latency <= 0 && tune_ratio <= 0))) {
+		usage(argv[0]);
+		return -1;
+	}
 
-	header head(block_size, index_len);
-	vector< uint16_t > index;
+	// Each thread builds its own, but catch unknown codecs up front
+	{
+		CompressorSet check;
+		string bad;
+		if (!check.init(policy, bad)) {
+			cerr << "Unknown codec: " << bad << endl;
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if (threads == 0)
+		threads = 1;
 
-	index.reserve(index_len);
+	// Sources are mapped where possible, and otherwise read as a stream.
+	// A live database can be read through SQLite for a consistent snapshot.
+	bool from_stdin = strcmp(src, "-") == 0;
+	MappedFile map;
+	SnapshotSource snap;
+	ifstream in_file;
+	StreamSource stream(from_stdin ? (istream &) cin : (istream &) in_file);
+	ArchiveSource archive(block_size);
+	Source * source = &map;
+	bool to_stdout = strcmp(dst, "-") == 0;
 
-	string uncompressed( block_size, '\0' );
-	string compressed( MaxCompressedLength(block_size), '\0' );
+	if (archive_path) {
+		// Every source is mapped, so that blocks can be compared to dedup
+		for (int i = arg; i < argc; i++) {
+			if (strcmp(argv[i], "-") == 0) {
+				cerr << "An archive can't be read from stdin" << endl;
+				return -1;
+			}
+			if (!archive.add(argv[i]))
+				return -1;
+		}
+		source = &archive;
+		flags |= FLAG_DIRECTORY;
+	} else if (snapshot) {
+		if (from_stdin || !snap.open(src)) {
+			cerr << "Failed to open source database: " << src << endl;
+			return -1;
+		}
+		if (snap.has_pages()) {
+			source = &snap;
+		} else if (!snap.is_wal()) {
+			// Our read transaction stops writers committing, so the file
+			// itself is the snapshot
+			if (!map.open(src)) {
+				cerr << "Failed to map source file: " << src << endl;
+				return -1;
+			}
+		} else {
+			// Pages may still be in the WAL, so copy the snapshot out
+			char tmp[] = "/tmp/snappy-sqlite-XXXXXX";
+			int fd = mkstemp(tmp);
+			if (fd < 0) {
+				cerr << "Failed to create temporary file: " << strerror(errno) << endl;
+				return -1;
+			}
+			close(fd);
+			bool ok = snap.backup(tmp) && map.open(tmp);
+			unlink(tmp);
+			if (!ok)
+				return -1;
+		}
+	} else if (from_stdin || !map.open(src)) {
+		if (!from_stdin) {
+			in_file.open(src, ios::binary | ios::in);
+			if (!in_file) {
+				cerr << "Failed to open source file: " << src << endl;
+				return -1;
+			}
+		}
+		source = &stream;
+	}
 
-	long long in_total = 0, out_total = 0;
+	// Without the size up front, or on stdout which can't seek, the index
+	// goes in a footer
+	if (source->size() < 0 || to_stdout)
+		flags |= FLAG_FOOTER_INDEX;
 
-	in_file.seekg(0, ios_base::beg);
+	ofstream out_file;
+	if (!to_stdout) {
+		out_file.open(dst, ios::binary | ios::out);
+		if (!out_file) {
+			cerr << "Failed to open output file: " << dst << endl;
+			return -1;
+		}
+	}
+	ostream & out = to_stdout ? cout : out_file;
+	ostream & report = to_stdout ? cerr : cout;
+//	out.exceptions(ios::badbit | ios::failbit);
 
-	int index_bytes = index_len * sizeof(uint16_t);
-	int data_start  = index_bytes + sizeof(head);
-	out_file.seekp(data_start, ios_base::beg);
+	PageClassifier classifier;
+	ArchiveClassifier archive_classifier;
+	uint64_t in_len_total = 0;
+	if (source == &map) {
+		in_len_total = map.size();
+		classifier.load(map.get_data(), in_len_total);
+		if (keep_free)
+			classifier.keep_free_pages();
+	} else if (source == &archive) {
+		in_len_total = archive.size();
+		for (size_t i = 0; i < archive.get_members().size(); i++) {
+			const archive_member & m = archive.get_members()[i];
+			archive_classifier.add(archive.get_data(i), m.raw_size, m.first_block * block_size, keep_free);
+		}
+	} else if (source->size() >= 0) {
+		in_len_total = source->size();
+	}
 
-	while (in_file.good()) {
-		in_file.read(string_as_array(&uncompressed), uncompressed.size());
-		if (in_file.bad()) {
-			cerr << "Error while reading source " << in_file.rdstate() << endl;
+	// Tuning samples blocks from all over the file, so it has to be mapped
+	if (tune) {
+		if (source != &map) {
+			cerr << "--tune needs a source file that can be mapped" << endl;
 			return -1;
 		}
+		size_t overhead = (flags & FLAG_OFFSET_INDEX ? sizeof(uint64_t) : sizeof(uint32_t)) +
+		                  (flags & FLAG_BLOCK_HASHES ? sizeof(uint64_t) : 0);
+		Tuner tuner(map.get_data(), in_len_total, classifier, tune_sample, tune_latency, tune_ratio,
+		            overhead);
+		if (!tuner.tune(block_size, policy, report))
+			return -1;
+	}
+
+	// Size the output buffers for the worst of the codecs
+	size_t max_out;
+	{
+		CompressorSet check;
+		string bad;
+		check.init(policy, bad);
+		max_out = check.max_compressed_length(block_size);
+	}
+
+	// A base that doesn't line up is no use, but no reason to stop either
+	BaseFile base_file;
+	const BaseFile * base = NULL;
+	if (base_path != NULL && base_file.open(base_path)) {
+		if (base_file.get_block_size() == block_size)
+			base = &base_file;
+		else
+			cerr << "Base file has a block size of " << base_file.get_block_size() << ", not " << block_size << endl;
+	}
+	if (base_path != NULL && base == NULL)
+		cerr << "Compressing every block" << endl;
+
+	string directory;
+	if (flags & FLAG_DIRECTORY)
+		directory = encode_directory(archive.get_members());
+
+	header head(block_size, in_len_total, flags, directory.size());
+	vector< uint32_t > index;
+	vector< uint64_t > hashes;
 
-		size_t in_len = in_file.gcount();
-		uncompressed.resize(in_len);
-		in_total += in_len;
+	index.reserve(head.block_count);
+	hashes.reserve(head.block_count);
 
-		assert(in_len > 0);
+	long long in_total = 0, out_total = 0, reused = 0, holes = 0, refs = 0;
+	long long class_blocks[PAGE_CLASSES] = {0};
+	long long class_in[PAGE_CLASSES] = {0}, class_out[PAGE_CLASSES] = {0};
 
-		compressor->compress(uncompressed, compressed);
+	char head_buf[FORMAT_HEADER_SIZE];
+	if (flags & FLAG_FOOTER_INDEX) {
+		head.encode(head_buf);
+		out.write(head_buf, sizeof(head_buf));
+	} else {
+		out.seekp(head.data_offset, ios_base::beg);
+	}
+
+	// Keep enough blocks in flight to cover a slow one, but bound memory
+	Pipeline pipeline(policy, threads, block_size, max_out, !source->in_place(), base, max_entropy, dedup);
+	chrono::steady_clock::time_point last_progress = chrono::steady_clock::now();
+
+	auto write_block = [&] (block_job * job) {
+		enum page_class c = job->page_class;
 
 		// write compressed to file
-		out_file.write(compressed.data(), compressed.size());
-		if (out_file.bad()) {
+		out.write(job->out, job->out_len);
+		if (out.bad()) {
 			cerr << "Error while writing to destination" << endl;
-			return -1;
+			return false;
 		}
 
-		out_total += compressed.size();
-		index.push_back(compressed.size()); // Store the size of this block
-	}
+		in_total += job->in_len;
+		out_total += job->out_len;
+		class_blocks[c]++;
+		class_in[c] += job->in_len;
+		class_out[c] += job->out_len;
+
+		// Store the size and codec of this block
+		index.push_back(job->out_len | ((uint32_t) job->codec << INDEX_CODEC_SHIFT));
+		hashes.push_back(job->hash);
+		if (job->reused)
+			reused++;
+		if (job->codec == CODEC_HOLE)
+			holes++;
+		if (job->codec == CODEC_REF)
+			refs++;
 
-	assert(index.size() > 0);
-	assert(index.size() == index_len);
+		if (progress && chrono::steady_clock::now() - last_progress > chrono::seconds(1)) {
+			last_progress = chrono::steady_clock::now();
+			cerr << "\r" << (pipeline.get_read_bytes() >> 20) << " MiB read, "
+			     << (in_total >> 20) << " MiB compressed to " << (out_total >> 20) << " MiB" << flush;
+		}
+		return true;
+	};
+	bool ok = source == &archive ? pipeline.run(source, archive_classifier, write_block)
+	                             : pipeline.run(source, classifier, write_block);
+	if (progress)
+		cerr << endl;
+	if (!ok)
+		return -1;
 	in_file.close();
 
-	// Seek to the beginning of the file and write the header / index
-	out_file.clear();
-	out_file.seekp(0, ios_base::beg);
-	out_file.write( reinterpret_cast<char*>(&head), sizeof(head));
-	out_file.write( reinterpret_cast<char*>(&index[0]), index_len * sizeof(index[0]) );
+	uint64_t index_bytes;
+	if (flags & FLAG_FOOTER_INDEX) {
+		// Append the index, page aligned if it is to be mapped, and trailer
+		head.block_count = index.size();
+		head.raw_size = in_total;
+		head.index_offset = head.data_offset + out_total;
+		if (flags & FLAG_OFFSET_INDEX)
+			head.index_offset = (head.index_offset + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+
+		string pad(head.index_offset - head.data_offset - out_total, '\0');
+		string index_buf = head.encode_index(index);
+		string hash_buf = head.encode_hashes(hashes);
+		char trailer_buf[FORMAT_TRAILER_SIZE];
+		head.encode_trailer(trailer_buf);
+
+		out.write(pad.data(), pad.size());
+		out.write(index_buf.data(), index_buf.size());
+		out.write(hash_buf.data(), hash_buf.size());
+		out.write(directory.data(), directory.size());
+		out.write(trailer_buf, sizeof(trailer_buf));
+		out.flush();
+		index_bytes = index_buf.size() + hash_buf.size() + directory.size();
+	} else {
+		assert(index.size() == head.block_count);
+		assert((uint64_t) in_total == head.raw_size);
+
+		// Seek to the beginning of the file and write the header / index
+		head.encode(head_buf);
+		string index_buf = head.encode_index(index);
+		string hash_buf = head.encode_hashes(hashes);
 
-	if (out_file.bad()) {
+		out.clear();
+		out.seekp(0, ios_base::beg);
+		out.write(head_buf, sizeof(head_buf));
+		out.seekp(head.index_offset, ios_base::beg);
+		out.write(index_buf.data(), index_buf.size());
+		out.write(hash_buf.data(), hash_buf.size());
+		out.write(directory.data(), directory.size());
+		index_bytes = head.data_offset - head.index_offset;
+
+		// Without any blocks nothing has been written out to data_offset
+		if (out_total == 0) {
+			string pad(head.data_offset - (uint64_t) out.tellp(), '\0');
+			out.write(pad.data(), pad.size());
+		}
+
+		assert( out.bad() || (uint64_t) out.tellp() <= head.data_offset );
+	}
+
+	if (out.bad()) {
 		cerr << "Error while writing index to destination: " << strerror(errno) << endl;
 		return -1;
 	}
 
-	assert( out_file.tellp() == data_start );
-
 	out_file.close();
 
-	cout << "Uncompressed: " << (in_total / 1024) << " KiB " << endl
-	     << "  Compressed: " << (out_total / 1024) << " KiB + "
-	     << "Index: " << (index_bytes / 1024) << " KiB " << endl
-	     << "       Ratio: x" << ((float)in_total / (float)(out_total + index_bytes))
-	     << endl;
+	report << "Uncompressed: " << (in_total / 1024) << " KiB " << endl
+	       << "  Compressed: " << (out_total / 1024) << " KiB + "
+	       << "Index: " << (index_bytes / 1024) << " KiB " << endl
+	       << "       Ratio: x" << ((float)in_total / (float)(out_total + index_bytes))
+	       << endl;
+	if (source == &archive)
+		report << "     Archive: " << archive.get_members().size() << " databases" << endl;
+	if (base != NULL)
+		report << "      Reused: " << reused << " of " << index.size() << " blocks from " << base_path << endl;
+	if (holes != 0)
+		report << "       Holes: " << holes << " blocks of zeros or free pages, not stored" << endl;
+	if (refs != 0)
+		report << "  Duplicates: " << refs << " blocks stored as references to an earlier copy" << endl;
+	if (pipeline.get_skipped() != 0)
+		report << "     Skipped: " << pipeline.get_skipped() << " blocks of over " << max_entropy
+		       << " bits per byte, stored raw" << endl;
+
+	// Where each stage waited on its neighbours, to find the bottleneck
+	report << "      Stalls: read " << (pipeline.reader.stall_ns / 1000000) << " ms, "
+	       << "compress " << (pipeline.compressor.stall_ns / 1000000) << " ms over "
+	       << threads << " threads, write " << (pipeline.writer.stall_ns / 1000000) << " ms"
+	       << endl;
+
+	size_t page_size = source == &archive ? archive_classifier.get_page_size() : classifier.get_page_size();
+	if (page_size != 0) {
+		report << "   Page size: " << page_size << endl;
+		for (int c = 0; c < PAGE_CLASSES; c++) {
+			if (class_blocks[c] == 0)
+				continue;
+			report << "  " << page_class_names[c] << ": " << class_blocks[c] << " blocks, " << policy[c];
+			if (class_out[c] != 0)
+				report << ", x" << ((float)class_in[c] / (float)class_out[c]) << endl;
+			else
+				report << ", all holes" << endl;
+		}
+	}
 
 	return 0;
 }
@@ -0,0 +1,277 @@
+#include <string>
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "format.h"
+#include "codecs.h"
+
+using namespace std;
+
+
+/**
+ * Turns a file written by snappy-sqlite back into the database it came
+ * from, or with --verify just checks that every block decompresses to the
+ * right length and, where the file has block hashes, the right bytes.
+ *
+ * Blocks are independent, so threads take runs of them from a shared
+ * counter and write each run with one pwrite() at its place in the output.
+ * For one database out of an archive, only its blocks are taken, and the
+ * output is cut off at its own length.
+ */
+class Restorer {
+
+	const CompressedFile & file;
+	int out_fd;                  // -1 to only verify
+	uint64_t first_block;        // Of the database being restored
+	uint64_t end_block;          // Block after its last
+	uint64_t raw_size;           // Its length, which the output is cut to
+	size_t run_blocks;           // Blocks taken at a time
+
+	atomic<uint64_t> next;       // First block not yet taken
+	atomic<uint64_t> bad_blocks;
+	atomic<bool> write_failed;
+	mutex report_lock;
+
+	// Report a bad block, up to a point
+	void bad(uint64_t i, const char * why) {
+		if (bad_blocks++ < 10) {
+			lock_guard<mutex> lock(report_lock);
+			cerr << "Block " << i << ": " << why << endl;
+		}
+	}
+
+	/**
+	 * Decompress block i into out, which has room for its raw length.
+	 * Returns false, having reported it, if the block is bad.
+	 */
+	bool decompress_block(uint64_t i, char * out) {
+		size_t len, raw_len = file.get_raw_length(i);
+		enum codec codec;
+		uint64_t stored = file.resolve(i);
+		if (stored == file.get_block_count()) {
+			bad(i, "bad reference");
+			return false;
+		}
+		const char * in = file.get_block(stored, len, codec);
+
+		if (!decompress(codec, in, len, out, raw_len)) {
+			bad(i, "failed to decompress");
+			return false;
+		}
+		if (file.has_hashes() && block_hash(out, raw_len) != file.get_hash(i)) {
+			bad(i, "hash does not match");
+			return false;
+		}
+		return true;
+	}
+
+	void work() {
+		vector<char> buf(run_blocks * file.get_block_size());
+
+		while (!write_failed) {
+			uint64_t first = next.fetch_add(run_blocks);
+			if (first >= end_block)
+				break;
+			uint64_t last = min<uint64_t>(first + run_blocks, end_block);
+
+			size_t len = 0;
+			// A bad block is written as zeros rather than whatever was left
+			// in buf, though the output is removed in the end anyway
+			for (uint64_t i = first; i < last; i++) {
+				if (!decompress_block(i, &buf[len]))
+					memset(&buf[len], 0, file.get_raw_length(i));
+				len += file.get_raw_length(i);
+			}
+
+			// The last block of a database in an archive is padded
+			uint64_t offset = (first - first_block) * file.get_block_size();
+			len = min<uint64_t>(len, raw_size - offset);
+			if (out_fd >= 0 && pwrite_all(&buf[0], len, offset) != 0) {
+				lock_guard<mutex> lock(report_lock);
+				if (!write_failed.exchange(true))
+					cerr << "Error while writing to destination: " << strerror(errno) << endl;
+			}
+		}
+	}
+
+	int pwrite_all(const char * p, size_t len, uint64_t offset) {
+		while (len > 0) {
+			ssize_t n = pwrite(out_fd, p, len, offset);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return -1;
+			p += n;
+			len -= n;
+			offset += n;
+		}
+		return 0;
+	}
+
+public:
+	// Restore all of file, or with member just that database out of it
+	Restorer(const CompressedFile & file, int out_fd, const archive_member * member = NULL)
+		: file(file), out_fd(out_fd), first_block(0), end_block(file.get_block_count()),
+		  raw_size(file.get_raw_size()), bad_blocks(0), write_failed(false) {
+		if (member != NULL) {
+			first_block = member->first_block;
+			raw_size = member->raw_size;
+			end_block = first_block + (raw_size + file.get_block_size() - 1) / file.get_block_size();
+		}
+		next = first_block;
+		// About a MiB per run, so writes are large but threads stay busy
+		run_blocks = max<size_t>(1, (1 << 20) / file.get_block_size());
+	}
+
+	// Restore or verify every block on threads threads. Returns false on error.
+	bool run(unsigned threads) {
+		vector<thread> workers;
+		for (unsigned i = 0; i < threads; i++)
+			workers.push_back(thread(&Restorer::work, this));
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+		return bad_blocks == 0 && !write_failed;
+	}
+
+	uint64_t get_bad_blocks() const { return bad_blocks; }
+	uint64_t get_blocks() const { return end_block - first_block; }
+	uint64_t get_raw_size() const { return raw_size; }
+};
+
+/**
+ * Restore file, or with member one database out of it, to dst on threads
+ * threads, or with dst NULL only verify it. Adds what was done to blocks,
+ * bad_blocks and bytes. Returns false on error.
+ */
+bool restore(const CompressedFile & file, const archive_member * member, const char * dst,
+             unsigned threads, uint64_t & blocks, uint64_t & bad_blocks, uint64_t & bytes) {
+	int out_fd = -1;
+	uint64_t raw_size = member ? member->raw_size : file.get_raw_size();
+	if (dst != NULL) {
+		out_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out_fd < 0 || ftruncate(out_fd, raw_size) != 0) {
+			cerr << "Failed to open output file: " << dst << ": " << strerror(errno) << endl;
+			return false;
+		}
+	}
+
+	Restorer restorer(file, out_fd, member);
+	bool ok = restorer.run(threads);
+	if (out_fd >= 0 && close(out_fd) != 0) {
+		cerr << "Error while writing to destination: " << strerror(errno) << endl;
+		ok = false;
+	}
+	if (out_fd >= 0 && !ok) {
+		unlink(dst);
+		cerr << "Removed the incomplete output file: " << dst << endl;
+	}
+	blocks += restorer.get_blocks();
+	bad_blocks += restorer.get_bad_blocks();
+	bytes += restorer.get_raw_size();
+	return ok;
+}
+
+void usage(const char * argv0) {
+	cerr << "Usage: " << argv0 << " [--threads=T] {source} {dest}" << endl
+	     << "       " << argv0 << " [--threads=T] --verify {source}" << endl
+	     << "  T is the number of decompression threads, default one per core" << endl
+	     << "  --verify decompresses every block, and checks it against its hash" << endl
+	     << "        if the file has them, without writing anything" << endl
+	     << "  A source written with --archive restores every database into the" << endl
+	     << "        directory dest, or just one named NAME as source/NAME" << endl;
+}
+
+int main(int argc, const char *argv[]) {
+	unsigned threads = thread::hardware_concurrency();
+	bool verify = false;
+
+	int arg = 1;
+	for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+		const char * eq = strchr(argv[arg], '=');
+		if (eq && string(argv[arg] + 2, eq) == "threads") {
+			threads = strtoul(eq + 1, NULL, 10);
+			continue;
+		}
+		if (strcmp(argv[arg], "--verify") == 0) {
+			verify = true;
+			continue;
+		}
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (argc - arg != (verify ? 1 : 2)) {
+		usage(argv[0]);
+		return -1;
+	}
+	if (threads == 0)
+		threads = 1;
+
+	// A database in an archive is named as if the archive were a directory
+	string src = argv[arg], name;
+	size_t slash = src.rfind('/');
+	if (slash != string::npos && slash >= 4 && slash + 1 < src.size() && src.compare(slash - 4, 4, ".zsq") == 0) {
+		name = src.substr(slash + 1);
+		src.erase(slash);
+	}
+
+	CompressedFile file;
+	if (!file.open(src.c_str()))
+		return -1;
+
+	const vector<archive_member> & members = file.get_members();
+	const archive_member * member = NULL;
+	for (size_t i = 0; i < members.size() && !name.empty(); i++) {
+		if (members[i].name == name)
+			member = &members[i];
+	}
+	if (!name.empty() && member == NULL) {
+		cerr << "No database named " << name << " in " << src << endl;
+		return -1;
+	}
+
+	if (lzo_init() != LZO_E_OK) {
+		cerr << "Failed to init LZO" << endl;
+		return -1;
+	}
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	uint64_t blocks = 0, bad_blocks = 0, bytes = 0;
+	bool ok = true;
+	if (verify || member != NULL || members.empty()) {
+		ok = restore(file, member, verify ? NULL : argv[arg + 1], threads, blocks, bad_blocks, bytes);
+	} else {
+		// The whole archive, a database at a time into the dest directory
+		string dir = argv[arg + 1];
+		if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+			cerr << "Failed to create output directory: " << dir << ": " << strerror(errno) << endl;
+			return -1;
+		}
+		for (size_t i = 0; i < members.size() && ok; i++)
+			ok = restore(file, &members[i], (dir + "/" + members[i].name).c_str(), threads,
+			             blocks, bad_blocks, bytes);
+	}
+	double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	cout << "      Blocks: " << blocks << ", " << bad_blocks << " bad"
+	     << (file.has_hashes() ? "" : " (no hashes, lengths checked only)") << endl;
+	if (!members.empty())
+		cout << "     Archive: " << (member ? 1 : members.size()) << " of "
+		     << members.size() << " databases" << endl;
+	cout << "Uncompressed: " << (bytes / 1024) << " KiB in " << secs << " s" << endl
+	     << "  Throughput: " << (bytes / secs / 1e9) << " GB/s over "
+	     << threads << " threads" << endl;
+
+	return ok ? 0 : -1;
+}